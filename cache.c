@@ -0,0 +1,560 @@
+/*
+ * Copyright (C) 2001, 2002 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cache.h"
+#include "parse.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* Bump when the layout of PACKAGE_CACHE_TYPE or its contents change */
+#define PACKAGE_CACHE_VERSION 1
+
+/* format version, path, size, mtime, key, pcfiledir, name, version,
+ * description, url, orig_prefix, requires, requires.private, conflicts,
+ * libs, cflags, variables, libs_num, libs_private_num
+ */
+#define PACKAGE_CACHE_TYPE \
+  "(usxxssmsmsmsmsmsa(sums)a(sums)a(sums)a(ys)a(ys)a{ss}ii)"
+
+const char *
+cache_directory (void)
+{
+  const char *dir = g_getenv ("PKG_CONFIG_CACHE_DIR");
+
+  if (dir == NULL || *dir == '\0')
+    return NULL;
+
+  return dir;
+}
+
+/* Name the cache entry after a checksum of everything besides the file's
+ * contents that affects the parsed result: the key and path, the parse
+ * options, the global variables and any PKG_CONFIG_* environment
+ * variables, since those can override package variables.
+ */
+static char *
+package_cache_file_name (const char *key, const char *path,
+                         gboolean ignore_requires,
+                         gboolean ignore_private_libs,
+                         gboolean ignore_requires_private)
+{
+  GString *str;
+  gchar *checksum;
+  gchar *filename;
+
+  str = g_string_new (NULL);
+  g_string_append_printf (str, "%s%c%s%c%d%d%d%d%c%s%c",
+                          key, 0, path, 0,
+                          ignore_requires, ignore_private_libs,
+                          ignore_requires_private, define_prefix, 0,
+                          prefix_variable, 0);
+#ifdef G_OS_WIN32
+  g_string_append_printf (str, "%d%c", msvc_syntax, 0);
+#endif
+  global_variables_to_string (str);
+  environment_variables_to_string (str);
+
+  checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+                                          (const guchar *) str->str,
+                                          str->len);
+  filename = g_build_filename (cache_directory (), "packages", checksum,
+                               NULL);
+  g_free (checksum);
+  g_string_free (str, TRUE);
+
+  return filename;
+}
+
+static GVariant *
+required_versions_to_variant (GList *list)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sums)"));
+  for (; list != NULL; list = g_list_next (list))
+    {
+      RequiredVersion *ver = list->data;
+
+      g_variant_builder_add (&builder, "(sums)", ver->name,
+                             (guint32) ver->comparison, ver->version);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+static GList *
+required_versions_from_variant (Package *pkg, GVariant *variant)
+{
+  GVariantIter iter;
+  GList *retval = NULL;
+  char *name;
+  guint32 comparison;
+  char *version;
+
+  g_variant_iter_init (&iter, variant);
+  while (g_variant_iter_next (&iter, "(&sum&s)", &name, &comparison,
+                              &version))
+    {
+      RequiredVersion *ver = package_alloc (pkg, sizeof (RequiredVersion));
+
+      ver->name = name;
+      ver->comparison = comparison;
+      ver->version = version;
+      ver->owner = pkg;
+      retval = g_list_prepend (retval, ver);
+    }
+
+  return g_list_reverse (retval);
+}
+
+static GVariant *
+flags_to_variant (GList *list)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ys)"));
+  for (; list != NULL; list = g_list_next (list))
+    {
+      Flag *flag = list->data;
+
+      g_variant_builder_add (&builder, "(ys)", flag->type, flag->arg);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+static GList *
+flags_from_variant (Package *pkg, GVariant *variant)
+{
+  GVariantIter iter;
+  GList *retval = NULL;
+  guint8 type;
+  char *arg;
+
+  g_variant_iter_init (&iter, variant);
+  while (g_variant_iter_next (&iter, "(y&s)", &type, &arg))
+    {
+      Flag *flag = package_alloc (pkg, sizeof (Flag));
+
+      flag->type = type;
+      flag->arg = g_intern_string (arg);
+      retval = g_list_prepend (retval, flag);
+    }
+
+  return g_list_reverse (retval);
+}
+
+static GVariant *
+vars_to_variant (GHashTable *vars)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer name;
+  gpointer value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{ss}"));
+  g_hash_table_iter_init (&iter, vars);
+  while (g_hash_table_iter_next (&iter, &name, &value))
+    g_variant_builder_add (&builder, "{ss}", name,
+                           ((Variable *) value)->value);
+
+  return g_variant_builder_end (&builder);
+}
+
+/* Load a package from its cache entry. The strings of the returned
+ * package point directly into the mapped entry, which stays mapped for
+ * the rest of the process.
+ */
+Package *
+package_cache_load (const char *key, const char *path,
+                    gboolean ignore_requires,
+                    gboolean ignore_private_libs,
+                    gboolean ignore_requires_private)
+{
+  struct stat st;
+  char *filename;
+  GMappedFile *mapped;
+  GVariant *entry;
+  GVariant *requires;
+  GVariant *requires_private;
+  GVariant *conflicts;
+  GVariant *libs;
+  GVariant *cflags;
+  GVariantIter *vars;
+  Package *pkg;
+  guint32 format;
+  char *entry_path;
+  gint64 size;
+  gint64 mtime;
+  char *name;
+  char *value;
+
+  if (stat (path, &st) != 0)
+    return NULL;
+
+  filename = package_cache_file_name (key, path, ignore_requires,
+                                      ignore_private_libs,
+                                      ignore_requires_private);
+  mapped = g_mapped_file_new (filename, FALSE, NULL);
+  if (mapped == NULL || g_mapped_file_get_length (mapped) == 0)
+    {
+      debug_spew ("No package cache entry for '%s'\n", path);
+      if (mapped)
+        g_mapped_file_unref (mapped);
+      g_free (filename);
+      return NULL;
+    }
+  g_free (filename);
+
+  entry = g_variant_new_from_data (G_VARIANT_TYPE (PACKAGE_CACHE_TYPE),
+                                   g_mapped_file_get_contents (mapped),
+                                   g_mapped_file_get_length (mapped),
+                                   FALSE,
+                                   (GDestroyNotify) g_mapped_file_unref,
+                                   mapped);
+  g_variant_ref_sink (entry);
+
+  g_variant_get_child (entry, 0, "u", &format);
+  g_variant_get_child (entry, 1, "&s", &entry_path);
+  g_variant_get_child (entry, 2, "x", &size);
+  g_variant_get_child (entry, 3, "x", &mtime);
+
+  if (format != PACKAGE_CACHE_VERSION || strcmp (entry_path, path) != 0 ||
+      size != st.st_size || mtime != st.st_mtime)
+    {
+      debug_spew ("Package cache entry for '%s' is out of date\n", path);
+      g_variant_unref (entry);
+      return NULL;
+    }
+
+  pkg = package_new ();
+  g_variant_get (entry, "(u&sxx&s&sm&sm&sm&sm&sm&s@a(sums)@a(sums)@a(sums)"
+                 "@a(ys)@a(ys)a{ss}ii)",
+                 NULL, NULL, NULL, NULL,
+                 &pkg->key, &pkg->pcfiledir, &pkg->name, &pkg->version,
+                 &pkg->description, &pkg->url, &pkg->orig_prefix,
+                 &requires, &requires_private, &conflicts, &libs, &cflags,
+                 &vars, &pkg->libs_num, &pkg->libs_private_num);
+  pkg->key = (char *) g_intern_string (pkg->key);
+  pkg->pcfiledir = (char *) g_intern_string (pkg->pcfiledir);
+
+  pkg->requires_entries = required_versions_from_variant (pkg, requires);
+  pkg->requires_private_entries =
+    required_versions_from_variant (pkg, requires_private);
+  pkg->conflicts = required_versions_from_variant (pkg, conflicts);
+  pkg->libs = flags_from_variant (pkg, libs);
+  pkg->cflags = flags_from_variant (pkg, cflags);
+
+  while (g_variant_iter_next (vars, "{&s&s}", &name, &value))
+    package_set_var (pkg, name, value, TRUE);
+
+  g_variant_iter_free (vars);
+  g_variant_unref (requires);
+  g_variant_unref (requires_private);
+  g_variant_unref (conflicts);
+  g_variant_unref (libs);
+  g_variant_unref (cflags);
+
+  debug_spew ("Loaded '%s' from the package cache\n", path);
+
+  return pkg;
+}
+
+/* Write the cache entry for a freshly parsed package. Files modified in
+ * the current second are skipped since another modification in the same
+ * second wouldn't change their mtime.
+ */
+void
+package_cache_store (Package *pkg, const char *path,
+                     gboolean ignore_requires,
+                     gboolean ignore_private_libs,
+                     gboolean ignore_requires_private)
+{
+  struct stat st;
+  char *filename;
+  char *dirname;
+  GVariant *entry;
+  GError *error = NULL;
+
+  if (stat (path, &st) != 0 || st.st_mtime >= time (NULL))
+    return;
+
+  /* Entries hold split flags and expanded variables, so load them now
+   * rather than on first use
+   */
+  parse_package_flags (pkg);
+  parse_package_variables (pkg);
+
+  entry = g_variant_new ("(usxxssmsmsmsmsms@a(sums)@a(sums)@a(sums)"
+                         "@a(ys)@a(ys)@a{ss}ii)",
+                         (guint32) PACKAGE_CACHE_VERSION, path,
+                         (gint64) st.st_size, (gint64) st.st_mtime,
+                         pkg->key, pkg->pcfiledir, pkg->name, pkg->version,
+                         pkg->description, pkg->url, pkg->orig_prefix,
+                         required_versions_to_variant (pkg->requires_entries),
+                         required_versions_to_variant
+                           (pkg->requires_private_entries),
+                         required_versions_to_variant (pkg->conflicts),
+                         flags_to_variant (pkg->libs),
+                         flags_to_variant (pkg->cflags),
+                         vars_to_variant (pkg->vars),
+                         pkg->libs_num, pkg->libs_private_num);
+  g_variant_ref_sink (entry);
+
+  filename = package_cache_file_name (pkg->key, path, ignore_requires,
+                                      ignore_private_libs,
+                                      ignore_requires_private);
+  dirname = g_path_get_dirname (filename);
+
+  if (g_mkdir_with_parents (dirname, 0755) != 0)
+    debug_spew ("Cannot create cache directory '%s': %s\n",
+                dirname, g_strerror (errno));
+  else if (!g_file_set_contents (filename, g_variant_get_data (entry),
+                                 g_variant_get_size (entry), &error))
+    {
+      debug_spew ("Cannot write package cache entry: %s\n", error->message);
+      g_error_free (error);
+    }
+  else
+    debug_spew ("Stored '%s' in the package cache\n", path);
+
+  g_free (dirname);
+  g_free (filename);
+  g_variant_unref (entry);
+}
+
+/* Bump when the layout of RESULT_CACHE_TYPE changes */
+#define RESULT_CACHE_VERSION 1
+
+/* format version, output, exit status, and the size and mtime of every
+ * search directory and .pc file the result depends on
+ */
+#define RESULT_CACHE_TYPE "(usia(sxx))"
+
+/* Environment variables besides PKG_CONFIG_* that affect the output */
+static const char *result_envvars[] = {
+  "CPATH",
+  "C_INCLUDE_PATH",
+  "CPP_INCLUDE_PATH",
+#ifdef G_OS_WIN32
+  "INCLUDE",
+#endif
+  NULL
+};
+
+/* Results aren't cached when debugging or logging, since those write
+ * something on every run that a cached result couldn't replay.
+ */
+gboolean
+result_cache_enabled (void)
+{
+  return cache_directory () != NULL &&
+    g_getenv ("PKG_CONFIG_CACHE_RESULTS") != NULL &&
+    g_getenv ("PKG_CONFIG_DEBUG_SPEW") == NULL &&
+    g_getenv ("PKG_CONFIG_LOG") == NULL;
+}
+
+/* Name the result cache entry after a checksum of the command line and
+ * everything in the environment that can change its output.
+ */
+char *
+result_cache_key (int argc, char **argv)
+{
+  GString *str;
+  gchar **envvars;
+  gchar **var;
+  const char **name;
+  gchar *cwd;
+  gchar *checksum;
+  gchar *filename;
+  int i;
+
+  cwd = g_get_current_dir ();
+  str = g_string_new (NULL);
+  g_string_append_printf (str, "%s%c%s%c%s%c%s%c%s%c", VERSION, 0,
+                          pkg_config_pc_path, 0,
+                          PKG_CONFIG_SYSTEM_INCLUDE_PATH, 0,
+                          PKG_CONFIG_SYSTEM_LIBRARY_PATH, 0, cwd, 0);
+  g_free (cwd);
+
+  g_string_append_printf (str, "%d%c", argc, 0);
+  for (i = 1; i < argc; i++)
+    g_string_append_printf (str, "%s%c", argv[i], 0);
+
+  envvars = g_listenv ();
+  g_qsort_with_data (envvars, g_strv_length (envvars), sizeof (gchar *),
+                     (GCompareDataFunc) g_strcmp0, NULL);
+  for (var = envvars; *var != NULL; var++)
+    {
+      if (g_str_has_prefix (*var, "PKG_CONFIG_"))
+        g_string_append_printf (str, "%s=%s%c", *var, g_getenv (*var), 0);
+    }
+  g_strfreev (envvars);
+
+  for (name = result_envvars; *name != NULL; name++)
+    {
+      const char *value = g_getenv (*name);
+
+      if (value != NULL)
+        g_string_append_printf (str, "%s=%s%c", *name, value, 0);
+    }
+
+  checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+                                          (const guchar *) str->str,
+                                          str->len);
+  filename = g_build_filename (cache_directory (), "results", checksum,
+                               NULL);
+  g_free (checksum);
+  g_string_free (str, TRUE);
+
+  return filename;
+}
+
+/* Size and mtime of a dependency, both -1 if it doesn't exist */
+static void
+stat_dependency (const char *path, gint64 *size, gint64 *mtime)
+{
+  struct stat st;
+
+  if (stat (*path ? path : G_DIR_SEPARATOR_S, &st) != 0)
+    {
+      *size = -1;
+      *mtime = -1;
+      return;
+    }
+
+  *size = st.st_size;
+  *mtime = st.st_mtime;
+}
+
+/* Look up the result of an earlier identical query. On a hit its output
+ * is appended to output and its exit status stored in exit_status.
+ */
+gboolean
+result_cache_lookup (const char *key, GString *output, int *exit_status)
+{
+  gchar *contents;
+  gsize length;
+  GVariant *entry;
+  GVariantIter *deps;
+  guint32 format;
+  const char *stored_output;
+  gint32 status;
+  const char *path;
+  gint64 size;
+  gint64 mtime;
+  gboolean valid;
+
+  if (!g_file_get_contents (key, &contents, &length, NULL))
+    return FALSE;
+
+  entry = g_variant_new_from_data (G_VARIANT_TYPE (RESULT_CACHE_TYPE),
+                                   contents, length, FALSE, g_free, contents);
+  g_variant_ref_sink (entry);
+
+  g_variant_get (entry, "(u&sia(sxx))", &format, &stored_output, &status,
+                 &deps);
+
+  valid = format == RESULT_CACHE_VERSION;
+  while (valid && g_variant_iter_next (deps, "(&sxx)", &path, &size, &mtime))
+    {
+      gint64 cur_size;
+      gint64 cur_mtime;
+
+      stat_dependency (path, &cur_size, &cur_mtime);
+      valid = cur_size == size && cur_mtime == mtime;
+    }
+  g_variant_iter_free (deps);
+
+  if (valid)
+    {
+      g_string_append (output, stored_output);
+      *exit_status = status;
+    }
+
+  g_variant_unref (entry);
+
+  return valid;
+}
+
+static void
+add_dependencies (GVariantBuilder *builder, GList *paths, time_t now,
+                  gboolean *racy)
+{
+  for (; paths != NULL; paths = g_list_next (paths))
+    {
+      gint64 size;
+      gint64 mtime;
+
+      stat_dependency (paths->data, &size, &mtime);
+      if (mtime >= now)
+        *racy = TRUE;
+
+      g_variant_builder_add (builder, "(sxx)", paths->data, size, mtime);
+    }
+}
+
+/* Store the result of a query along with the state of the search
+ * directories and .pc files it was computed from. Results depending on
+ * anything modified in the current second aren't stored, since another
+ * modification in the same second wouldn't change its mtime.
+ */
+void
+result_cache_store (const char *key, const char *output, int exit_status,
+                    GList *dirs, GList *files)
+{
+  GVariantBuilder builder;
+  GVariant *entry;
+  gboolean racy = FALSE;
+  time_t now = time (NULL);
+  char *dirname;
+  GError *error = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sxx)"));
+  add_dependencies (&builder, dirs, now, &racy);
+  add_dependencies (&builder, files, now, &racy);
+
+  entry = g_variant_new ("(usi@a(sxx))", (guint32) RESULT_CACHE_VERSION,
+                         output, (gint32) exit_status,
+                         g_variant_builder_end (&builder));
+  g_variant_ref_sink (entry);
+
+  if (racy)
+    {
+      g_variant_unref (entry);
+      return;
+    }
+
+  dirname = g_path_get_dirname (key);
+  if (g_mkdir_with_parents (dirname, 0755) == 0 &&
+      !g_file_set_contents (key, g_variant_get_data (entry),
+                            g_variant_get_size (entry), &error))
+    g_error_free (error);
+
+  g_free (dirname);
+  g_variant_unref (entry);
+}
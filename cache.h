@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2001, 2002 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef PKG_CONFIG_CACHE_H
+#define PKG_CONFIG_CACHE_H
+
+#include "pkg.h"
+
+/* Directory holding the persistent caches, or NULL if caching is
+ * disabled. Set with the PKG_CONFIG_CACHE_DIR environment variable.
+ */
+const char *cache_directory (void);
+
+/* Cache of parsed .pc files, stored as one serialized GVariant per file
+ * under $PKG_CONFIG_CACHE_DIR/packages. Entries are keyed by the file's
+ * path, size and mtime and by everything else that affects parsing.
+ */
+Package *package_cache_load  (const char *key, const char *path,
+                              gboolean ignore_requires,
+                              gboolean ignore_private_libs,
+                              gboolean ignore_requires_private);
+void     package_cache_store (Package    *pkg, const char *path,
+                              gboolean ignore_requires,
+                              gboolean ignore_private_libs,
+                              gboolean ignore_requires_private);
+
+/* Cache of complete query results under $PKG_CONFIG_CACHE_DIR/results,
+ * enabled by setting PKG_CONFIG_CACHE_RESULTS. Entries are keyed by the
+ * command line and environment and validated against every search
+ * directory and .pc file the result was computed from.
+ */
+gboolean result_cache_enabled (void);
+char *   result_cache_key     (int         argc,
+                               char      **argv);
+gboolean result_cache_lookup  (const char *key,
+                               GString    *output,
+                               int        *exit_status);
+void     result_cache_store   (const char *key,
+                               const char *output,
+                               int         exit_status,
+                               GList      *dirs,
+                               GList      *files);
+
+#endif
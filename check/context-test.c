@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2001, 2002 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/* Exercises libpkg-config against the test .pc files. Takes the
+ * directory holding them and prints one line per failed check.
+ */
+
+#include "context.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define THREAD_QUERY_MODULES "public-dep simple"
+#define THREAD_QUERY_RESULT \
+  "-I/public-dep/include -L/public-dep/lib -lpublic-dep -lsimple"
+
+/* Query whichever snapshot is current, counting wrong answers */
+static gpointer
+query_thread (gpointer data)
+{
+  PkgConfigSnapshot **location = data;
+  int wrong = 0;
+  int i;
+
+  for (i = 0; i < 500; i++)
+    {
+      PkgConfigSnapshot *snapshot = pkg_config_snapshot_acquire (location);
+      char *result;
+
+      result = pkg_config_snapshot_get_flags (snapshot, THREAD_QUERY_MODULES,
+                                              PKG_CONFIG_CFLAGS |
+                                              PKG_CONFIG_LIBS, NULL);
+      if (result == NULL || strcmp (result, THREAD_QUERY_RESULT) != 0)
+        wrong++;
+      g_free (result);
+      pkg_config_snapshot_unref (snapshot);
+    }
+
+  return GINT_TO_POINTER (wrong);
+}
+
+static void
+check_result (const char *what, char *result, GError *error,
+              const char *expected)
+{
+  if (result == NULL)
+    {
+      printf ("%s: unexpected error: %s\n", what, error->message);
+      failures++;
+      g_error_free (error);
+    }
+  else if (strcmp (result, expected) != 0)
+    {
+      printf ("%s: got '%s', expected '%s'\n", what, result, expected);
+      failures++;
+    }
+  g_free (result);
+}
+
+static void
+check_error (const char *what, gboolean success, GError *error,
+             PkgConfigError code, const char *message)
+{
+  if (success)
+    {
+      printf ("%s: unexpected success\n", what);
+      failures++;
+    }
+  else if (!g_error_matches (error, PKG_CONFIG_ERROR, code) ||
+           strstr (error->message, message) == NULL)
+    {
+      printf ("%s: got error %d '%s', expected %d containing '%s'\n",
+              what, error->code, error->message, code, message);
+      failures++;
+    }
+  g_clear_error (&error);
+}
+
+int
+main (int argc, char **argv)
+{
+  PkgConfigContext *context;
+  PkgConfigContext *sysroot_context;
+  PkgConfigSnapshot *snapshot;
+  PkgConfigSnapshot *current = NULL;
+  GThread *threads[4];
+  int wrong = 0;
+  int i;
+  GError *error = NULL;
+  gboolean success;
+  char *result;
+
+  if (argc != 2)
+    {
+      fprintf (stderr, "usage: %s PCDIR\n", argv[0]);
+      return 2;
+    }
+
+  context = pkg_config_context_new ();
+  pkg_config_context_set_path (context, argv[1], TRUE);
+
+  result = pkg_config_context_get_flags (context, "simple",
+                                         PKG_CONFIG_LIBS, &error);
+  check_result ("libs", result, error, "-lsimple");
+  error = NULL;
+
+  result = pkg_config_context_get_flags (context, "public-dep",
+                                         PKG_CONFIG_CFLAGS, &error);
+  check_result ("cflags", result, error, "-I/public-dep/include");
+  error = NULL;
+
+  result = pkg_config_context_get_version (context, "simple", &error);
+  check_result ("version", result, error, "1.0.0");
+  error = NULL;
+
+  result = pkg_config_context_get_variable (context, "simple", "libdir",
+                                            &error);
+  check_result ("variable", result, error, "/usr/lib");
+  error = NULL;
+
+  pkg_config_context_define_variable (context, "prefix", "/opt");
+  result = pkg_config_context_get_variable (context, "simple", "libdir",
+                                            &error);
+  check_result ("define variable", result, error, "/opt/lib");
+  error = NULL;
+
+  /* Environment overrides are seen even after the package was read */
+  g_setenv ("PKG_CONFIG_SIMPLE_PREFIX", "/env", TRUE);
+  result = pkg_config_context_get_variable (context, "simple", "libdir",
+                                            &error);
+  check_result ("environment variable", result, error, "/env/lib");
+  error = NULL;
+  g_unsetenv ("PKG_CONFIG_SIMPLE_PREFIX");
+
+  result = pkg_config_context_get_variable (context, "simple", "libdir",
+                                            &error);
+  check_result ("unset environment variable", result, error, "/opt/lib");
+  error = NULL;
+
+  pkg_config_context_set_static (context, TRUE);
+  result = pkg_config_context_get_flags (context, "simple",
+                                         PKG_CONFIG_LIBS, &error);
+  check_result ("static libs", result, error, "-lsimple -lm");
+  error = NULL;
+
+  success = pkg_config_context_exists (context, "pkg-non-existent", &error);
+  check_error ("missing package", success, error, PKG_CONFIG_ERROR_NOT_FOUND,
+               "No package 'pkg-non-existent' found");
+  error = NULL;
+
+  success = pkg_config_context_exists (context, "simple > 1.0.0", &error);
+  check_error ("version mismatch", success, error, PKG_CONFIG_ERROR_VERSION,
+               "Requested 'simple > 1.0.0' but version of");
+  error = NULL;
+
+  /* Fails deep inside the requires resolution, where pkg-config exits */
+  result = pkg_config_context_get_flags (context, "missing-requires",
+                                         PKG_CONFIG_LIBS, &error);
+  check_error ("missing requires", result != NULL, error,
+               PKG_CONFIG_ERROR_FAILED,
+               "required by 'missing-requires', not found");
+  error = NULL;
+
+  /* Contexts don't see each other's settings */
+  sysroot_context = pkg_config_context_new ();
+  pkg_config_context_set_path (sysroot_context, argv[1], TRUE);
+  pkg_config_context_set_sysroot (sysroot_context, "/sysroot");
+  result = pkg_config_context_get_flags (sysroot_context, "public-dep",
+                                         PKG_CONFIG_CFLAGS, &error);
+  check_result ("sysroot", result, error, "-I/sysroot/public-dep/include");
+  error = NULL;
+
+  result = pkg_config_context_get_flags (context, "public-dep",
+                                         PKG_CONFIG_CFLAGS, &error);
+  check_result ("no sysroot", result, error, "-I/public-dep/include");
+  error = NULL;
+
+  /* Snapshots answer like the context they came from */
+  snapshot = pkg_config_context_snapshot (sysroot_context);
+  result = pkg_config_snapshot_get_flags (snapshot, "public-dep",
+                                          PKG_CONFIG_CFLAGS, &error);
+  check_result ("snapshot flags", result, error,
+                "-I/sysroot/public-dep/include");
+  error = NULL;
+
+  result = pkg_config_snapshot_get_version (snapshot, "simple", &error);
+  check_result ("snapshot version", result, error, "1.0.0");
+  error = NULL;
+
+  result = pkg_config_snapshot_get_variable (snapshot, "simple", "libdir",
+                                             &error);
+  check_result ("snapshot variable", result, error, "/usr/lib");
+  error = NULL;
+
+  success = pkg_config_snapshot_exists (snapshot, "pkg-non-existent", &error);
+  check_error ("snapshot missing package", success, error,
+               PKG_CONFIG_ERROR_NOT_FOUND,
+               "No package 'pkg-non-existent' found");
+  error = NULL;
+
+  success = pkg_config_snapshot_exists (snapshot, "missing-requires", &error);
+  check_error ("snapshot missing requires", success, error,
+               PKG_CONFIG_ERROR_FAILED,
+               "required by 'missing-requires', not found");
+  error = NULL;
+  pkg_config_snapshot_unref (snapshot);
+
+  /* Threads keep querying while new snapshots replace the current one */
+  pkg_config_snapshot_publish (&current,
+                               pkg_config_context_snapshot (sysroot_context));
+  pkg_config_context_set_sysroot (sysroot_context, NULL);
+  pkg_config_snapshot_publish (&current,
+                               pkg_config_context_snapshot (sysroot_context));
+  for (i = 0; i < G_N_ELEMENTS (threads); i++)
+    threads[i] = g_thread_new ("query", query_thread, &current);
+  for (i = 0; i < 10; i++)
+    pkg_config_snapshot_publish (&current,
+                                 pkg_config_context_snapshot (sysroot_context));
+  for (i = 0; i < G_N_ELEMENTS (threads); i++)
+    wrong += GPOINTER_TO_INT (g_thread_join (threads[i]));
+  if (wrong > 0)
+    {
+      printf ("threads: %d wrong answers\n", wrong);
+      failures++;
+    }
+  pkg_config_snapshot_publish (&current, NULL);
+
+  pkg_config_context_free (sysroot_context);
+  pkg_config_context_free (context);
+
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2001, 2002 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/* Times splitting .pc files into lines. Not built by default; run
+ * "make parse-bench" here, then for example
+ *
+ *   ./parse-bench 1000 `find /usr/lib/pkgconfig -name '*.pc'`
+ *
+ * The files are read into memory once and split the given number of
+ * rounds. Without files, a synthetic corpus of long lines is used.
+ */
+
+#include "parse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SYNTHETIC_FILES 100
+
+/* Something like a .pc file with many long flag lists */
+static GString *
+synthetic_file (int n)
+{
+  GString *file = g_string_new (NULL);
+  int i;
+
+  g_string_append_printf (file,
+                          "# Synthetic package %d\n"
+                          "prefix=/opt/synthetic/%d\n"
+                          "libdir=${prefix}/lib\n"
+                          "includedir=${prefix}/include\n\n"
+                          "Name: synthetic-%d\n"
+                          "Description: Synthetic package number %d\n"
+                          "Version: 1.%d\n"
+                          "Requires: glib-2.0 >= 2.32, gobject-2.0\n",
+                          n, n, n, n, n);
+
+  g_string_append (file, "Libs: -L${libdir}");
+  for (i = 0; i < 40; i++)
+    g_string_append_printf (file, " -lsynthetic%d-part%d", n, i);
+  g_string_append (file, "\nCflags: -I${includedir} \\\n");
+  for (i = 0; i < 40; i++)
+    g_string_append_printf (file, " -DSYNTHETIC_%d_OPTION_%d=1 # comment\n"
+                            "  -I${includedir}/part%d \\\n", n, i, i);
+  g_string_append (file, "\n");
+
+  return file;
+}
+
+int
+main (int argc, char **argv)
+{
+  GPtrArray *files = g_ptr_array_new ();
+  GString *line = g_string_new (NULL);
+  gsize bytes = 0;
+  guint lines = 0;
+  GTimer *timer;
+  double elapsed;
+  int rounds;
+  int i;
+  guint j;
+
+  if (argc < 2 || (rounds = atoi (argv[1])) <= 0)
+    {
+      fprintf (stderr, "usage: %s ROUNDS [FILE...]\n", argv[0]);
+      return 2;
+    }
+
+  for (i = 2; i < argc; i++)
+    {
+      GError *error = NULL;
+      char *contents;
+      gsize length;
+
+      if (!g_file_get_contents (argv[i], &contents, &length, &error))
+        {
+          fprintf (stderr, "%s\n", error->message);
+          return 1;
+        }
+      g_ptr_array_add (files, g_string_new_len (contents, length));
+      g_free (contents);
+    }
+
+  if (files->len == 0)
+    for (i = 0; i < SYNTHETIC_FILES; i++)
+      g_ptr_array_add (files, synthetic_file (i));
+
+  for (j = 0; j < files->len; j++)
+    bytes += ((GString *) g_ptr_array_index (files, j))->len;
+
+  timer = g_timer_new ();
+  for (i = 0; i < rounds; i++)
+    for (j = 0; j < files->len; j++)
+      {
+        GString *file = g_ptr_array_index (files, j);
+        const char *buf = file->str;
+
+        while (read_one_line (&buf, file->str + file->len, line))
+          lines++;
+      }
+  elapsed = g_timer_elapsed (timer, NULL);
+
+  printf ("%u files, %" G_GSIZE_FORMAT " bytes, %u lines per round\n",
+          files->len, bytes, lines / rounds);
+  printf ("%.1f ns per file, %.2f GB/s\n",
+          elapsed * 1e9 / ((double) rounds * files->len),
+          (double) bytes * rounds / elapsed / 1e9);
+
+  return 0;
+}
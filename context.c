@@ -0,0 +1,796 @@
+/*
+ * Copyright (C) 2001, 2002 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "context.h"
+#include "pkg.h"
+#include "parse.h"
+#include "index.h"
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct _PkgConfigContext
+{
+  PackageState state;
+  char *path;               /* searched first, like PKG_CONFIG_PATH */
+  char *libdir;             /* replaces the default, like PKG_CONFIG_LIBDIR */
+  GHashTable *variables;    /* global variables by name */
+  gboolean static_libs;
+};
+
+/* Everything a snapshot query reads. None of it changes once built. */
+struct _PkgConfigSnapshot
+{
+  gint ref_count;
+  GHashTable *packages;     /* fully resolved packages by name */
+  GHashTable *broken;       /* error messages by package name */
+  GHashTable *globals;      /* global variables by name */
+  char *sysroot;
+  gboolean static_libs;
+};
+
+/* The message handlers of one thread */
+typedef struct
+{
+  MessageHandler debug_spew;
+  MessageHandler verbose_error;
+  FatalErrorHandler fatal_error;
+} MessageHandlers;
+
+/* A query in progress. Fatal errors return to its setjmp. */
+typedef struct ContextCall_ ContextCall;
+struct ContextCall_
+{
+  jmp_buf jmp;
+  PkgConfigContext *context;
+  PkgConfigError code;
+  GString *errors;          /* messages reported by the query */
+  GList *reqs;              /* module list being looked up */
+  GList *packages;          /* packages found for it so far */
+  MessageHandlers saved;
+  ContextCall *previous;
+};
+
+static GPrivate thread_handlers = G_PRIVATE_INIT (g_free);
+static GPrivate thread_call = G_PRIVATE_INIT (NULL);
+
+/* Set while a context's state is swapped into the process globals */
+static gint context_entered = 0;
+
+static MessageHandlers *
+get_handlers (void)
+{
+  MessageHandlers *handlers = g_private_get (&thread_handlers);
+
+  if (handlers == NULL)
+    {
+      handlers = g_new0 (MessageHandlers, 1);
+      g_private_set (&thread_handlers, handlers);
+    }
+
+  return handlers;
+}
+
+void
+set_message_handlers (MessageHandler    debug_spew_func,
+                      MessageHandler    verbose_error_func,
+                      FatalErrorHandler fatal_error_func)
+{
+  MessageHandlers *handlers = get_handlers ();
+
+  handlers->debug_spew = debug_spew_func;
+  handlers->verbose_error = verbose_error_func;
+  handlers->fatal_error = fatal_error_func;
+}
+
+void
+debug_spew (const char *format, ...)
+{
+  MessageHandlers *handlers = get_handlers ();
+  va_list args;
+
+  g_return_if_fail (format != NULL);
+
+  if (handlers->debug_spew == NULL)
+    return;
+
+  va_start (args, format);
+  handlers->debug_spew (format, args);
+  va_end (args);
+}
+
+void
+verbose_error (const char *format, ...)
+{
+  MessageHandlers *handlers = get_handlers ();
+  va_list args;
+
+  g_return_if_fail (format != NULL);
+
+  if (handlers->verbose_error == NULL)
+    return;
+
+  va_start (args, format);
+  handlers->verbose_error (format, args);
+  va_end (args);
+}
+
+void
+fatal_error (void)
+{
+  MessageHandlers *handlers = get_handlers ();
+
+  if (handlers->fatal_error != NULL)
+    handlers->fatal_error ();
+
+  exit (1);
+}
+
+GQuark
+pkg_config_error_quark (void)
+{
+  return g_quark_from_static_string ("pkg-config-error-quark");
+}
+
+static void
+collect_error (const char *format, va_list args)
+{
+  ContextCall *call = g_private_get (&thread_call);
+
+  g_string_append_vprintf (call->errors, format, args);
+}
+
+static void
+abandon_call (void)
+{
+  ContextCall *call = g_private_get (&thread_call);
+
+  longjmp (call->jmp, 1);
+}
+
+static void
+free_module_list (GList *reqs)
+{
+  GList *iter;
+
+  for (iter = reqs; iter != NULL; iter = g_list_next (iter))
+    {
+      RequiredVersion *ver = iter->data;
+
+      g_free (ver->name);
+      g_free (ver->version);
+      g_free (ver);
+    }
+  g_list_free (reqs);
+}
+
+/* Collect the calling thread's messages for a query */
+static void
+call_begin (ContextCall *call)
+{
+  MessageHandlers *handlers = get_handlers ();
+
+  call->context = NULL;
+  call->code = PKG_CONFIG_ERROR_FAILED;
+  call->errors = g_string_new (NULL);
+  call->reqs = NULL;
+  call->packages = NULL;
+  call->saved = *handlers;
+  call->previous = g_private_get (&thread_call);
+  g_private_set (&thread_call, call);
+
+  set_message_handlers (NULL, collect_error, abandon_call);
+}
+
+static gboolean
+call_end (ContextCall *call, gboolean success, GError **error)
+{
+  *get_handlers () = call->saved;
+  g_private_set (&thread_call, call->previous);
+
+  if (!success)
+    {
+      g_strstrip (call->errors->str);
+      g_set_error_literal (error, PKG_CONFIG_ERROR, call->code,
+                           *call->errors->str ? call->errors->str :
+                           "Query failed");
+    }
+  g_string_free (call->errors, TRUE);
+  free_module_list (call->reqs);
+  g_list_free (call->packages);
+
+  return success;
+}
+
+/* Make the context's state current and collect its messages */
+static void
+context_enter (PkgConfigContext *context, ContextCall *call)
+{
+  if (!g_atomic_int_compare_and_exchange (&context_entered, 0, 1))
+    g_error ("Only one pkg-config context can be used at a time");
+
+  call_begin (call);
+  call->context = context;
+  package_state_swap (&context->state);
+}
+
+static gboolean
+context_leave (ContextCall *call, gboolean success, GError **error)
+{
+  package_state_swap (&call->context->state);
+  g_atomic_int_set (&context_entered, 0);
+
+  return call_end (call, success, error);
+}
+
+/* Rebuild the search path and global variables after a setting changed */
+static void
+context_apply_settings (PkgConfigContext *context)
+{
+  ContextCall call;
+  GHashTableIter iter;
+  gpointer name;
+  gpointer value;
+
+  context_enter (context, &call);
+
+  g_list_foreach (context->state.search_dirs, (GFunc) g_free, NULL);
+  g_list_free (context->state.search_dirs);
+  context->state.search_dirs = NULL;
+  if (context->path != NULL)
+    add_search_dirs (context->path, G_SEARCHPATH_SEPARATOR_S);
+  add_search_dirs (context->libdir != NULL ?
+                   context->libdir : pkg_config_pc_path,
+                   G_SEARCHPATH_SEPARATOR_S);
+
+  clear_global_variables ();
+  g_hash_table_iter_init (&iter, context->variables);
+  while (g_hash_table_iter_next (&iter, &name, &value))
+    define_global_variable (name, value);
+
+  pcsysrootdir = g_hash_table_lookup (context->variables, "pc_sysrootdir");
+  if (strcmp (pcsysrootdir, "/") == 0)
+    pcsysrootdir = NULL;
+
+  context_leave (&call, TRUE, NULL);
+}
+
+PkgConfigContext *
+pkg_config_context_new (void)
+{
+  PkgConfigContext *context = g_new0 (PkgConfigContext, 1);
+
+  context->state.ignore_requires_private = TRUE;
+  context->state.ignore_private_libs = TRUE;
+  context->state.parse_strict = TRUE;
+  context->state.define_prefix = ENABLE_DEFINE_PREFIX;
+  context->state.prefix_variable = "prefix";
+  context->state.pkg_config_pc_path = PKG_CONFIG_PC_PATH;
+
+  context->variables = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, g_free);
+  g_hash_table_insert (context->variables, g_strdup ("pc_sysrootdir"),
+                       g_strdup ("/"));
+  g_hash_table_insert (context->variables, g_strdup ("pc_top_builddir"),
+                       g_strdup ("$(top_builddir)"));
+
+  context_apply_settings (context);
+
+  return context;
+}
+
+/* Parsed packages point into each other, and into shared package cache
+ * mappings, so they're left for the process to reclaim.
+ */
+void
+pkg_config_context_free (PkgConfigContext *context)
+{
+  if (context == NULL)
+    return;
+
+  g_list_foreach (context->state.search_dirs, (GFunc) g_free, NULL);
+  g_list_free (context->state.search_dirs);
+  if (context->state.globals != NULL)
+    g_hash_table_destroy (context->state.globals);
+  g_free (context->path);
+  g_free (context->libdir);
+  g_hash_table_destroy (context->variables);
+  g_free (context);
+}
+
+void
+pkg_config_context_set_path (PkgConfigContext *context,
+                             const char       *path,
+                             gboolean          replace_default)
+{
+  char **setting = replace_default ? &context->libdir : &context->path;
+
+  g_free (*setting);
+  *setting = g_strdup (path);
+  context_apply_settings (context);
+}
+
+void
+pkg_config_context_set_sysroot (PkgConfigContext *context,
+                                const char       *sysroot)
+{
+  pkg_config_context_define_variable (context, "pc_sysrootdir",
+                                      sysroot != NULL ? sysroot : "/");
+}
+
+void
+pkg_config_context_define_variable (PkgConfigContext *context,
+                                    const char       *name,
+                                    const char       *value)
+{
+  g_hash_table_insert (context->variables, g_strdup (name),
+                       g_strdup (value));
+  context_apply_settings (context);
+}
+
+void
+pkg_config_context_set_static (PkgConfigContext *context,
+                               gboolean          static_libs)
+{
+  context->static_libs = static_libs;
+}
+
+void
+pkg_config_context_set_define_prefix (PkgConfigContext *context,
+                                      gboolean          define_prefix)
+{
+  context->state.define_prefix = define_prefix;
+}
+
+/* Look up the packages in a module list and check their versions, the
+ * way the command line tool does for its arguments. The lists are kept
+ * in the call, so they're freed even if a fatal error cuts it short.
+ */
+static gboolean
+context_get_packages (ContextCall *call, const char *modules)
+{
+  gboolean success = TRUE;
+  GList *iter;
+
+  package_init (FALSE);
+
+  call->reqs = parse_module_list (NULL, modules, "(module list)");
+  if (call->reqs == NULL)
+    {
+      verbose_error ("No packages given\n");
+      return FALSE;
+    }
+
+  for (iter = call->reqs; iter != NULL; iter = g_list_next (iter))
+    {
+      RequiredVersion *ver = iter->data;
+      Package *req = get_package (ver->name);
+
+      if (req == NULL)
+        {
+          success = FALSE;
+          call->code = PKG_CONFIG_ERROR_NOT_FOUND;
+          verbose_error ("No package '%s' found\n", ver->name);
+          continue;
+        }
+
+      if (!version_test (ver->comparison, req->version, ver->version))
+        {
+          success = FALSE;
+          call->code = PKG_CONFIG_ERROR_VERSION;
+          verbose_error ("Requested '%s %s %s' but version of %s is %s\n",
+                         ver->name, comparison_to_str (ver->comparison),
+                         ver->version, req->name, req->version);
+          continue;
+        }
+
+      call->packages = g_list_prepend (call->packages, req);
+    }
+
+  call->packages = g_list_reverse (call->packages);
+
+  return success;
+}
+
+/* Which dependencies are followed, as decided by the command line tool
+ * for the equivalent options. Requires are only needed for flags and
+ * existence checks.
+ */
+static void
+context_set_requires (PkgConfigContext *context, FlagType flags,
+                      gboolean requires)
+{
+  if (context->static_libs)
+    enable_private_libs ();
+  else
+    disable_private_libs ();
+
+  if (flags & CFLAGS_ANY || (context->static_libs && flags & LIBS_ANY))
+    enable_requires_private ();
+  else
+    disable_requires_private ();
+
+  if (requires)
+    enable_requires ();
+  else
+    disable_requires ();
+}
+
+gboolean
+pkg_config_context_exists (PkgConfigContext *context,
+                           const char       *modules,
+                           GError          **error)
+{
+  ContextCall call;
+  volatile gboolean success = FALSE;
+
+  context_enter (context, &call);
+  if (setjmp (call.jmp) == 0)
+    {
+      /* --exists checks the private requirements too */
+      context_set_requires (context, CFLAGS_ANY, TRUE);
+      success = context_get_packages (&call, modules);
+    }
+  else
+    package_discard ();
+
+  return context_leave (&call, success, error);
+}
+
+char *
+pkg_config_context_get_flags (PkgConfigContext *context,
+                              const char       *modules,
+                              PkgConfigFlags    flags,
+                              GError          **error)
+{
+  ContextCall call;
+  char * volatile result = NULL;
+
+  context_enter (context, &call);
+  if (setjmp (call.jmp) == 0)
+    {
+      context_set_requires (context, flags, TRUE);
+      if (context_get_packages (&call, modules))
+        result = packages_get_flags (call.packages, flags);
+    }
+  else
+    package_discard ();
+
+  context_leave (&call, result != NULL, error);
+
+  return result;
+}
+
+char *
+pkg_config_context_get_variable (PkgConfigContext *context,
+                                 const char       *modules,
+                                 const char       *variable,
+                                 GError          **error)
+{
+  ContextCall call;
+  char * volatile result = NULL;
+
+  context_enter (context, &call);
+  if (setjmp (call.jmp) == 0)
+    {
+      context_set_requires (context, 0, FALSE);
+      if (context_get_packages (&call, modules))
+        result = packages_get_var (call.packages, variable);
+    }
+  else
+    package_discard ();
+
+  context_leave (&call, result != NULL, error);
+
+  return result;
+}
+
+char *
+pkg_config_context_get_version (PkgConfigContext *context,
+                                const char       *module,
+                                GError          **error)
+{
+  ContextCall call;
+  char * volatile result = NULL;
+
+  context_enter (context, &call);
+  if (setjmp (call.jmp) == 0)
+    {
+      context_set_requires (context, 0, FALSE);
+      if (context_get_packages (&call, module))
+        result = g_strdup (((Package *) call.packages->data)->version);
+    }
+  else
+    package_discard ();
+
+  context_leave (&call, result != NULL, error);
+
+  return result;
+}
+
+/* Load one package and everything it requires into the snapshot, or
+ * record why that isn't possible.
+ */
+static void
+snapshot_add_package (ContextCall *call, PkgConfigSnapshot *snapshot,
+                      const char *name)
+{
+  Package *pkg;
+
+  if (g_hash_table_contains (snapshot->packages, name) ||
+      g_hash_table_contains (snapshot->broken, name))
+    return;
+
+  g_string_truncate (call->errors, 0);
+  package_init (FALSE);
+  if (setjmp (call->jmp) == 0)
+    {
+      pkg = get_package_quiet (name);
+      if (pkg != NULL)
+        {
+          /* Queries on the snapshot mustn't modify it */
+          package_freeze (pkg);
+          g_hash_table_insert (snapshot->packages, g_strdup (name), pkg);
+        }
+    }
+  else
+    {
+      /* Packages that already made it into the snapshot are complete,
+       * so only the table needs discarding.
+       */
+      package_discard ();
+      g_strstrip (call->errors->str);
+      g_hash_table_insert (snapshot->broken, g_strdup (name),
+                           g_strdup (call->errors->str));
+    }
+}
+
+PkgConfigSnapshot *
+pkg_config_context_snapshot (PkgConfigContext *context)
+{
+  ContextCall call;
+  PkgConfigSnapshot *snapshot = g_new0 (PkgConfigSnapshot, 1);
+  GList *dirs;
+
+  snapshot->ref_count = 1;
+  snapshot->packages = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+  snapshot->broken = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free);
+  snapshot->static_libs = context->static_libs;
+
+  context_enter (context, &call);
+
+  /* Start over from what's on disk now */
+  index_invalidate (NULL);
+  package_invalidate (NULL);
+
+  /* Everything a flags query could follow has to be resolved up front */
+  context_set_requires (context, CFLAGS_ANY, TRUE);
+
+  snapshot_add_package (&call, snapshot, "pkg-config");
+  for (dirs = get_search_dirs (); dirs != NULL; dirs = g_list_next (dirs))
+    {
+      GList *names = index_dir_names (get_search_dirs (), dirs->data);
+      GList *iter;
+
+      for (iter = names; iter != NULL; iter = g_list_next (iter))
+        snapshot_add_package (&call, snapshot, iter->data);
+      g_list_free (names);
+    }
+
+  snapshot->globals = copy_global_variables ();
+  snapshot->sysroot = g_strdup (pcsysrootdir);
+
+  context_leave (&call, TRUE, NULL);
+
+  return snapshot;
+}
+
+PkgConfigSnapshot *
+pkg_config_snapshot_ref (PkgConfigSnapshot *snapshot)
+{
+  g_atomic_int_inc (&snapshot->ref_count);
+
+  return snapshot;
+}
+
+/* As with contexts, the packages themselves are left for the process to
+ * reclaim.
+ */
+void
+pkg_config_snapshot_unref (PkgConfigSnapshot *snapshot)
+{
+  if (snapshot == NULL || !g_atomic_int_dec_and_test (&snapshot->ref_count))
+    return;
+
+  g_hash_table_destroy (snapshot->packages);
+  g_hash_table_destroy (snapshot->broken);
+  g_hash_table_destroy (snapshot->globals);
+  g_free (snapshot->sysroot);
+  g_free (snapshot);
+}
+
+/* The low bit of the published pointer serves as a lock, held only
+ * while a reference is taken or the pointer replaced.
+ */
+#define SNAPSHOT_POINTER(location) \
+  ((PkgConfigSnapshot *) ((gsize) g_atomic_pointer_get (location) & ~(gsize) 1))
+
+PkgConfigSnapshot *
+pkg_config_snapshot_acquire (PkgConfigSnapshot **location)
+{
+  PkgConfigSnapshot *snapshot;
+
+  g_pointer_bit_lock (location, 0);
+  snapshot = SNAPSHOT_POINTER (location);
+  if (snapshot != NULL)
+    g_atomic_int_inc (&snapshot->ref_count);
+  g_pointer_bit_unlock (location, 0);
+
+  return snapshot;
+}
+
+void
+pkg_config_snapshot_publish (PkgConfigSnapshot **location,
+                             PkgConfigSnapshot  *snapshot)
+{
+  PkgConfigSnapshot *old;
+
+  g_pointer_bit_lock (location, 0);
+  old = SNAPSHOT_POINTER (location);
+  g_atomic_pointer_set (location, (gpointer) ((gsize) snapshot | 1));
+  g_pointer_bit_unlock (location, 0);
+
+  pkg_config_snapshot_unref (old);
+}
+
+/* Like context_get_packages, but only reads the snapshot */
+static gboolean
+snapshot_get_packages (PkgConfigSnapshot *snapshot, ContextCall *call,
+                       const char *modules)
+{
+  gboolean success = TRUE;
+  GList *iter;
+
+  call->reqs = parse_module_list_full (NULL, modules, "(module list)",
+                                       TRUE);
+  if (call->reqs == NULL)
+    {
+      verbose_error ("No packages given\n");
+      return FALSE;
+    }
+
+  for (iter = call->reqs; iter != NULL; iter = g_list_next (iter))
+    {
+      RequiredVersion *ver = iter->data;
+      Package *req = g_hash_table_lookup (snapshot->packages, ver->name);
+
+      if (req == NULL)
+        {
+          const char *problem = g_hash_table_lookup (snapshot->broken,
+                                                     ver->name);
+
+          success = FALSE;
+          if (problem != NULL)
+            verbose_error ("%s\n", problem);
+          else
+            {
+              call->code = PKG_CONFIG_ERROR_NOT_FOUND;
+              verbose_error ("No package '%s' found\n", ver->name);
+            }
+          continue;
+        }
+
+      if (!version_test (ver->comparison, req->version, ver->version))
+        {
+          success = FALSE;
+          call->code = PKG_CONFIG_ERROR_VERSION;
+          verbose_error ("Requested '%s %s %s' but version of %s is %s\n",
+                         ver->name, comparison_to_str (ver->comparison),
+                         ver->version, req->name, req->version);
+          continue;
+        }
+
+      call->packages = g_list_prepend (call->packages, req);
+    }
+
+  call->packages = g_list_reverse (call->packages);
+
+  return success;
+}
+
+gboolean
+pkg_config_snapshot_exists (PkgConfigSnapshot *snapshot,
+                            const char        *modules,
+                            GError           **error)
+{
+  ContextCall call;
+  volatile gboolean success = FALSE;
+
+  call_begin (&call);
+  if (setjmp (call.jmp) == 0)
+    success = snapshot_get_packages (snapshot, &call, modules);
+
+  return call_end (&call, success, error);
+}
+
+char *
+pkg_config_snapshot_get_flags (PkgConfigSnapshot *snapshot,
+                               const char        *modules,
+                               PkgConfigFlags     flags,
+                               GError           **error)
+{
+  ContextCall call;
+  char * volatile result = NULL;
+
+  call_begin (&call);
+  if (setjmp (call.jmp) == 0 &&
+      snapshot_get_packages (snapshot, &call, modules))
+    result = packages_get_flags_full (call.packages, flags,
+                                      snapshot->static_libs,
+                                      snapshot->sysroot);
+
+  call_end (&call, result != NULL, error);
+
+  return result;
+}
+
+char *
+pkg_config_snapshot_get_variable (PkgConfigSnapshot *snapshot,
+                                  const char        *modules,
+                                  const char        *variable,
+                                  GError           **error)
+{
+  ContextCall call;
+  char * volatile result = NULL;
+
+  call_begin (&call);
+  if (setjmp (call.jmp) == 0 &&
+      snapshot_get_packages (snapshot, &call, modules))
+    result = packages_get_var_full (call.packages, variable,
+                                    snapshot->globals);
+
+  call_end (&call, result != NULL, error);
+
+  return result;
+}
+
+char *
+pkg_config_snapshot_get_version (PkgConfigSnapshot *snapshot,
+                                 const char        *module,
+                                 GError           **error)
+{
+  ContextCall call;
+  char * volatile result = NULL;
+
+  call_begin (&call);
+  if (setjmp (call.jmp) == 0 &&
+      snapshot_get_packages (snapshot, &call, module))
+    result = g_strdup (((Package *) call.packages->data)->version);
+
+  call_end (&call, result != NULL, error);
+
+  return result;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2001, 2002 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef PKG_CONFIG_CONTEXT_H
+#define PKG_CONFIG_CONTEXT_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* libpkg-config answers the same queries as the pkg-config tool from
+ * within another program. Each context has its own search path,
+ * settings and parsed packages, and reports problems through GError
+ * rather than printing them or exiting.
+ *
+ * While a context call runs, the context's state is swapped into the
+ * process-wide globals the pkg-config tool itself uses, and swapped
+ * back out when the call returns. So only one context can be in use at
+ * a time: contexts may be used one after the other, from any thread,
+ * but two context calls must never overlap. Starting one while another
+ * is still running aborts the program.
+ *
+ * For queries from several threads, a context can load everything in
+ * its search path into a snapshot. Snapshots never change once made, so
+ * any number of threads can query one at the same time.
+ */
+
+typedef struct _PkgConfigContext PkgConfigContext;
+typedef struct _PkgConfigSnapshot PkgConfigSnapshot;
+
+typedef enum
+{
+  PKG_CONFIG_LIBS_l       = 1 << 0,
+  PKG_CONFIG_LIBS_L       = 1 << 1,
+  PKG_CONFIG_LIBS_OTHER   = 1 << 2,
+  PKG_CONFIG_CFLAGS_I     = 1 << 3,
+  PKG_CONFIG_CFLAGS_OTHER = 1 << 4,
+
+  PKG_CONFIG_LIBS   = PKG_CONFIG_LIBS_l | PKG_CONFIG_LIBS_L |
+                      PKG_CONFIG_LIBS_OTHER,
+  PKG_CONFIG_CFLAGS = PKG_CONFIG_CFLAGS_I | PKG_CONFIG_CFLAGS_OTHER
+} PkgConfigFlags;
+
+#define PKG_CONFIG_ERROR (pkg_config_error_quark ())
+
+typedef enum
+{
+  PKG_CONFIG_ERROR_NOT_FOUND,      /* a requested package is missing */
+  PKG_CONFIG_ERROR_VERSION,        /* a package's version doesn't match */
+  PKG_CONFIG_ERROR_FAILED          /* anything else, such as a bad .pc file */
+} PkgConfigError;
+
+GQuark pkg_config_error_quark (void);
+
+/* A new context searches the built-in path, like pkg-config run without
+ * PKG_CONFIG_PATH or PKG_CONFIG_LIBDIR set. The environment isn't
+ * consulted.
+ */
+PkgConfigContext *pkg_config_context_new  (void);
+void              pkg_config_context_free (PkgConfigContext *context);
+
+/* Settings matching the command line options and environment variables
+ * of the same names. They apply to later queries.
+ */
+void pkg_config_context_set_path          (PkgConfigContext *context,
+                                           const char       *path,
+                                           gboolean          replace_default);
+void pkg_config_context_set_sysroot       (PkgConfigContext *context,
+                                           const char       *sysroot);
+void pkg_config_context_define_variable   (PkgConfigContext *context,
+                                           const char       *name,
+                                           const char       *value);
+void pkg_config_context_set_static        (PkgConfigContext *context,
+                                           gboolean          static_libs);
+void pkg_config_context_set_define_prefix (PkgConfigContext *context,
+                                           gboolean          define_prefix);
+
+/* Queries take a module list as given on the command line, such as
+ * "glib-2.0 >= 2.24 gio-2.0". They return NULL and set error if a
+ * package is missing or doesn't satisfy its version.
+ */
+gboolean pkg_config_context_exists       (PkgConfigContext *context,
+                                          const char       *modules,
+                                          GError          **error);
+char *   pkg_config_context_get_flags    (PkgConfigContext *context,
+                                          const char       *modules,
+                                          PkgConfigFlags    flags,
+                                          GError          **error);
+char *   pkg_config_context_get_variable (PkgConfigContext *context,
+                                          const char       *modules,
+                                          const char       *variable,
+                                          GError          **error);
+char *   pkg_config_context_get_version  (PkgConfigContext *context,
+                                          const char       *module,
+                                          GError          **error);
+
+/* Read and resolve every package in the context's search path, with the
+ * context's current settings. Packages are read from disk again rather
+ * than taken from earlier queries, so this also serves to reload. A
+ * package whose requirements can't be satisfied is kept as the error
+ * any query for it reports.
+ */
+PkgConfigSnapshot *pkg_config_context_snapshot (PkgConfigContext  *context);
+PkgConfigSnapshot *pkg_config_snapshot_ref     (PkgConfigSnapshot *snapshot);
+void               pkg_config_snapshot_unref   (PkgConfigSnapshot *snapshot);
+
+/* Hand snapshots from the thread making them to the threads querying
+ * them. Publishing takes over the caller's reference and drops the one
+ * held on the snapshot it replaces; threads that acquired that one can
+ * keep using it until they unref it. location must start out NULL.
+ */
+void               pkg_config_snapshot_publish (PkgConfigSnapshot **location,
+                                                PkgConfigSnapshot  *snapshot);
+PkgConfigSnapshot *pkg_config_snapshot_acquire (PkgConfigSnapshot **location);
+
+/* The context queries, answered from a snapshot. Modules can only be
+ * named, not given as paths to .pc files.
+ */
+gboolean pkg_config_snapshot_exists       (PkgConfigSnapshot *snapshot,
+                                           const char        *modules,
+                                           GError           **error);
+char *   pkg_config_snapshot_get_flags    (PkgConfigSnapshot *snapshot,
+                                           const char        *modules,
+                                           PkgConfigFlags     flags,
+                                           GError           **error);
+char *   pkg_config_snapshot_get_variable (PkgConfigSnapshot *snapshot,
+                                           const char        *modules,
+                                           const char        *variable,
+                                           GError           **error);
+char *   pkg_config_snapshot_get_version  (PkgConfigSnapshot *snapshot,
+                                           const char        *module,
+                                           GError           **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,597 @@
+/*
+ * Copyright (C) 2001, 2002 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_GETDENTS64
+#define _GNU_SOURCE  /* for getdents64 */
+#endif
+
+#include "index.h"
+#include "cache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_GETDENTS64
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+/* The index is a text file. The header line is followed by one "d" line
+ * per directory, giving its modification time and path, and one "f" line
+ * per .pc file found in it, giving the file name without the extension.
+ */
+#define INDEX_HEADER "pkg-config-index 1\n"
+
+#ifdef G_OS_WIN32
+/* Guard against .pc file being installed with UPPER CASE name */
+# define FOLD_NAME(x) g_ascii_strdown (x, -1)
+#else
+# define FOLD_NAME(x) g_strdup (x)
+#endif
+
+typedef struct
+{
+  char *path;          /* directory as given in the search path */
+  gint64 mtime;        /* modification time when listed, -1 if missing */
+  GHashTable *names;   /* set of .pc file names without the extension */
+  gboolean checked;    /* mtime has been compared in this process */
+  gboolean persist;    /* entry can be trusted by later processes */
+} IndexDir;
+
+static GHashTable *index_dirs = NULL;   /* path -> IndexDir */
+static GPtrArray *index_path = NULL;    /* IndexDir for each search dir */
+static GHashTable *index_names = NULL;  /* name -> first path position */
+
+gboolean
+index_enabled (void)
+{
+  return cache_directory () != NULL;
+}
+
+static char *
+index_file_name (void)
+{
+  return g_build_filename (cache_directory (), "index", NULL);
+}
+
+/* Start over the entry for a directory. An existing entry is emptied
+ * and reused, so relisting a directory doesn't pile up old entries.
+ */
+static IndexDir *
+index_dir_new (const char *path, gint64 mtime)
+{
+  IndexDir *idir = g_hash_table_lookup (index_dirs, path);
+
+  if (idir != NULL)
+    {
+      g_hash_table_remove_all (idir->names);
+      idir->checked = FALSE;
+      idir->persist = FALSE;
+    }
+  else
+    {
+      idir = g_new0 (IndexDir, 1);
+      idir->path = g_strdup (path);
+      idir->names = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+      g_hash_table_insert (index_dirs, idir->path, idir);
+    }
+  idir->mtime = mtime;
+
+  return idir;
+}
+
+static void
+index_dir_free (gpointer data)
+{
+  IndexDir *idir = data;
+
+  g_hash_table_destroy (idir->names);
+  g_free (idir->path);
+  g_free (idir);
+}
+
+static GHashTable *
+index_dirs_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                index_dir_free);
+}
+
+static void
+index_dir_add_name (IndexDir *idir, const char *name)
+{
+  char *key = FOLD_NAME (name);
+
+  g_hash_table_replace (idir->names, key, key);
+}
+
+static gint64
+dir_mtime (const char *path)
+{
+  struct stat st;
+
+  if (stat (*path ? path : G_DIR_SEPARATOR_S, &st) != 0 ||
+      !S_ISDIR (st.st_mode))
+    return -1;
+
+  return st.st_mtime;
+}
+
+static void
+index_dir_add_file (IndexDir *idir, const char *filename)
+{
+  int len = strlen (filename);
+
+  if (len > 3 && g_ascii_strcasecmp (filename + len - 3, ".pc") == 0 &&
+      strchr (filename, '\n') == NULL)
+    {
+      char *name = g_strndup (filename, len - 3);
+      index_dir_add_name (idir, name);
+      g_free (name);
+    }
+}
+
+#ifdef HAVE_GETDENTS64
+/* Large enough to read most directories in a single call, where readdir
+ * would make one per 32k of entries.
+ */
+#define DIRENT_BUFFER_SIZE (256 * 1024)
+
+static gboolean
+index_dir_read (IndexDir *idir, const char *path)
+{
+  static char *buffer = NULL;
+  ssize_t len;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return FALSE;
+
+  if (buffer == NULL)
+    buffer = g_malloc (DIRENT_BUFFER_SIZE);
+
+  while ((len = getdents64 (fd, buffer, DIRENT_BUFFER_SIZE)) > 0)
+    {
+      ssize_t pos = 0;
+
+      while (pos < len)
+        {
+          struct dirent64 *entry = (struct dirent64 *) (buffer + pos);
+
+          index_dir_add_file (idir, entry->d_name);
+          pos += entry->d_reclen;
+        }
+    }
+
+  close (fd);
+
+  return len == 0;
+}
+#else
+static gboolean
+index_dir_read (IndexDir *idir, const char *path)
+{
+  GDir *dir;
+  const gchar *filename;
+  /* Use a copy of path cause Win32 opendir doesn't like superfluous
+   * trailing (back)slashes in the directory name.
+   */
+  char *path_copy = g_strdup (path);
+  int len = strlen (path_copy);
+
+  if (len > 1 && path_copy[len - 1] == G_DIR_SEPARATOR)
+    path_copy[len - 1] = '\0';
+
+  dir = g_dir_open (path_copy, 0, NULL);
+  g_free (path_copy);
+  if (!dir)
+    return FALSE;
+
+  while ((filename = g_dir_read_name (dir)))
+    index_dir_add_file (idir, filename);
+  g_dir_close (dir);
+
+  return TRUE;
+}
+#endif
+
+/* List the .pc files in a directory. The entry is only trusted by later
+ * processes when the directory wasn't modified in the second it was
+ * listed, otherwise a file added right after the listing would go unseen.
+ */
+static IndexDir *
+index_dir_list (const char *path)
+{
+  IndexDir *idir;
+  time_t now = time (NULL);
+
+  idir = index_dir_new (path, dir_mtime (path));
+  if (idir->mtime < 0)
+    return idir;
+
+  debug_spew ("Indexing directory '%s'\n", path);
+
+  if (!index_dir_read (idir, *path ? path : G_DIR_SEPARATOR_S))
+    {
+      debug_spew ("Cannot open directory '%s' in package search path: %s\n",
+                  path, g_strerror (errno));
+      return idir;
+    }
+
+  idir->persist = idir->mtime < now && strchr (path, '\n') == NULL;
+
+  return idir;
+}
+
+static void
+index_load (void)
+{
+  char *filename;
+  char *contents = NULL;
+  char *line;
+  IndexDir *idir = NULL;
+
+  filename = index_file_name ();
+  if (!g_file_get_contents (filename, &contents, NULL, NULL))
+    {
+      debug_spew ("No package index in '%s'\n", filename);
+      g_free (filename);
+      return;
+    }
+
+  if (strncmp (contents, INDEX_HEADER, strlen (INDEX_HEADER)) != 0)
+    {
+      debug_spew ("Ignoring package index '%s' with unknown format\n",
+                  filename);
+      g_free (contents);
+      g_free (filename);
+      return;
+    }
+
+  debug_spew ("Loading package index '%s'\n", filename);
+  g_free (filename);
+
+  line = contents + strlen (INDEX_HEADER);
+  while (*line)
+    {
+      char *end = strchr (line, '\n');
+
+      if (end == NULL)
+        break;
+      *end = '\0';
+
+      if (line[0] == 'd' && line[1] == ' ')
+        {
+          char *path;
+          gint64 mtime = g_ascii_strtoll (line + 2, &path, 10);
+
+          if (*path == ' ')
+            {
+              idir = index_dir_new (path + 1, mtime);
+              idir->persist = TRUE;
+            }
+          else
+            idir = NULL;
+        }
+      else if (line[0] == 'f' && line[1] == ' ' && idir != NULL)
+        index_dir_add_name (idir, line + 2);
+
+      line = end + 1;
+    }
+
+  g_free (contents);
+}
+
+static void
+index_write_foreach (gpointer key, gpointer value, gpointer data)
+{
+  IndexDir *idir = value;
+  GString *str = data;
+  GHashTableIter iter;
+  gpointer name;
+
+  if (!idir->persist)
+    return;
+
+  g_string_append_printf (str, "d %" G_GINT64_FORMAT " %s\n",
+                          idir->mtime, idir->path);
+
+  g_hash_table_iter_init (&iter, idir->names);
+  while (g_hash_table_iter_next (&iter, &name, NULL))
+    g_string_append_printf (str, "f %s\n", (char *) name);
+}
+
+/* The index is written to a temporary file and renamed into place, so
+ * concurrent processes see either the old or the new index.
+ */
+static gboolean
+index_write (GError **error)
+{
+  const char *cache_dir = cache_directory ();
+  char *filename;
+  GString *str;
+  gboolean retval;
+
+  if (g_mkdir_with_parents (cache_dir, 0755) != 0)
+    {
+      int errsv = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Cannot create cache directory '%s': %s",
+                   cache_dir, g_strerror (errsv));
+      return FALSE;
+    }
+
+  str = g_string_new (INDEX_HEADER);
+  g_hash_table_foreach (index_dirs, index_write_foreach, str);
+
+  filename = index_file_name ();
+  retval = g_file_set_contents (filename, str->str, str->len, error);
+  if (retval)
+    debug_spew ("Wrote package index '%s'\n", filename);
+
+  g_free (filename);
+  g_string_free (str, TRUE);
+
+  return retval;
+}
+
+static gboolean
+index_path_matches (GList *dirs)
+{
+  unsigned int i = 0;
+
+  for (; dirs != NULL; dirs = g_list_next (dirs), i++)
+    {
+      IndexDir *idir;
+
+      if (i >= index_path->len)
+        return FALSE;
+
+      idir = g_ptr_array_index (index_path, i);
+      if (strcmp (idir->path, dirs->data) != 0)
+        return FALSE;
+    }
+
+  return i == index_path->len;
+}
+
+static void
+index_init (GList *dirs)
+{
+  gboolean dirty = FALSE;
+  unsigned int path_position = 0;
+  GError *error = NULL;
+  GList *iter;
+
+  if (index_path != NULL)
+    {
+      if (index_path_matches (dirs))
+        return;
+
+      /* Another context with a different search path */
+      g_ptr_array_free (index_path, TRUE);
+      g_hash_table_destroy (index_names);
+    }
+
+  if (index_dirs == NULL)
+    {
+      index_dirs = index_dirs_new ();
+      if (index_enabled ())
+        index_load ();
+    }
+
+  index_path = g_ptr_array_new ();
+  index_names = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (iter = dirs; iter != NULL; iter = g_list_next (iter))
+    {
+      const char *path = iter->data;
+      IndexDir *idir = g_hash_table_lookup (index_dirs, path);
+      GHashTableIter name_iter;
+      gpointer name;
+
+      path_position++;
+
+      if (idir == NULL || !idir->checked)
+        {
+          gint64 mtime = dir_mtime (path);
+
+          if (idir == NULL || mtime < 0 || idir->mtime != mtime)
+            {
+              debug_spew ("Package index entry for '%s' is out of date\n",
+                          path);
+              dirty |= idir != NULL;
+              idir = index_dir_list (path);
+              dirty |= idir->persist;
+            }
+          idir->checked = TRUE;
+        }
+
+      g_ptr_array_add (index_path, idir);
+
+      g_hash_table_iter_init (&name_iter, idir->names);
+      while (g_hash_table_iter_next (&name_iter, &name, NULL))
+        {
+          if (!g_hash_table_lookup (index_names, name))
+            g_hash_table_insert (index_names, name,
+                                 GUINT_TO_POINTER (path_position));
+        }
+    }
+
+  if (dirty && index_enabled () && !index_write (&error))
+    {
+      debug_spew ("Cannot update package index: %s\n", error->message);
+      g_error_free (error);
+    }
+}
+
+/* Names with a directory part can't be answered from the listings, so
+ * they're looked up by trying each search directory in turn.
+ */
+static char *
+index_probe (GList *dirs, const char *name, unsigned int *path_position)
+{
+  unsigned int i = 0;
+
+  for (; dirs != NULL; dirs = g_list_next (dirs))
+    {
+      char *location = g_strdup_printf ("%s%c%s.pc", (char *) dirs->data,
+                                        G_DIR_SEPARATOR, name);
+
+      i++;
+      if (g_file_test (location, G_FILE_TEST_IS_REGULAR))
+        {
+          *path_position = i;
+          return location;
+        }
+      g_free (location);
+    }
+
+  return NULL;
+}
+
+/* Find the .pc file for a package name, returning its location and
+ * setting path_position, or NULL if it isn't in any search directory.
+ * A miss costs a single hash lookup. A hit is confirmed to be a regular
+ * file since the directory listing doesn't tell.
+ */
+char *
+index_lookup (GList *dirs, const char *name, unsigned int *path_position)
+{
+  char *key;
+  unsigned int i;
+
+  if (strchr (name, '/') != NULL || strchr (name, G_DIR_SEPARATOR) != NULL)
+    return index_probe (dirs, name, path_position);
+
+  index_init (dirs);
+
+  key = FOLD_NAME (name);
+  i = GPOINTER_TO_UINT (g_hash_table_lookup (index_names, key));
+
+  for (; i > 0 && i <= index_path->len; i++)
+    {
+      IndexDir *idir = g_ptr_array_index (index_path, i - 1);
+      char *location;
+
+      if (!g_hash_table_lookup (idir->names, key))
+        continue;
+
+      location = g_strdup_printf ("%s%c%s.pc", idir->path,
+                                  G_DIR_SEPARATOR, name);
+      if (g_file_test (location, G_FILE_TEST_IS_REGULAR))
+        {
+          g_free (key);
+          *path_position = i;
+          return location;
+        }
+      g_free (location);
+    }
+
+  g_free (key);
+  return NULL;
+}
+
+/* Return the names of the .pc files in one of the search directories,
+ * without the extension. The names belong to the index.
+ */
+GList *
+index_dir_names (GList *dirs, const char *path)
+{
+  IndexDir *idir;
+
+  index_init (dirs);
+
+  idir = g_hash_table_lookup (index_dirs, path);
+  if (idir == NULL)
+    idir = index_dir_list (path);
+
+  return g_hash_table_get_keys (idir->names);
+}
+
+/* Forget what's known about a directory's contents, so it's listed
+ * again the next time it's needed. A NULL path forgets all directories.
+ */
+void
+index_invalidate (const char *path)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  if (index_dirs == NULL)
+    return;
+
+  g_hash_table_iter_init (&iter, index_dirs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      IndexDir *idir = value;
+
+      if (path == NULL || strcmp (idir->path, path) == 0)
+        {
+          /* Can't match any real mtime */
+          idir->mtime = -2;
+          idir->checked = FALSE;
+        }
+    }
+
+  if (index_path != NULL)
+    {
+      g_ptr_array_free (index_path, TRUE);
+      g_hash_table_destroy (index_names);
+      index_path = NULL;
+      index_names = NULL;
+    }
+}
+
+gboolean
+index_rebuild (GList *dirs, GError **error)
+{
+  GList *iter;
+
+  /* The lookup tables point into the entries about to be freed */
+  if (index_path != NULL)
+    {
+      g_ptr_array_free (index_path, TRUE);
+      g_hash_table_destroy (index_names);
+      index_path = NULL;
+      index_names = NULL;
+    }
+  if (index_dirs != NULL)
+    g_hash_table_destroy (index_dirs);
+  index_dirs = index_dirs_new ();
+
+  for (iter = dirs; iter != NULL; iter = g_list_next (iter))
+    {
+      if (!g_hash_table_lookup (index_dirs, iter->data))
+        index_dir_list (iter->data);
+    }
+
+  return index_write (error);
+}
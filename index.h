@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2001, 2002 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef PKG_CONFIG_INDEX_H
+#define PKG_CONFIG_INDEX_H
+
+#include <glib.h>
+
+/* Index of the .pc files found in each search directory, so that each
+ * directory is listed once rather than probed for every package name.
+ * When enabled, it persists in $PKG_CONFIG_CACHE_DIR/index and each
+ * directory's entry is validated against the directory's modification
+ * time before use.
+ */
+
+gboolean index_enabled    (void);
+char *   index_lookup     (GList        *dirs,
+                           const char   *name,
+                           unsigned int *path_position);
+GList *  index_dir_names  (GList        *dirs,
+                           const char   *path);
+void     index_invalidate (const char   *path);
+gboolean index_rebuild    (GList        *dirs,
+                           GError      **error);
+
+#endif
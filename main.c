@@ -23,7 +23,10 @@
 
 #include "pkg.h"
 #include "parse.h"
+#include "cache.h"
+#include "server.h"
 
+#include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -35,9 +38,6 @@
 #undef STRICT
 #endif
 
-char *pcsysrootdir = NULL;
-char *pkg_config_pc_path = NULL;
-
 static gboolean want_my_version = FALSE;
 static gboolean want_version = FALSE;
 static FlagType pkg_flags = 0;
@@ -51,32 +51,49 @@ static gboolean want_provides = FALSE;
 static gboolean want_requires = FALSE;
 static gboolean want_requires_private = FALSE;
 static gboolean want_validate = FALSE;
+static gboolean want_rebuild_index = FALSE;
+static gboolean want_configure_check = FALSE;
+static gboolean want_json = FALSE;
+static gboolean want_batch = FALSE;
+static gboolean want_daemon = FALSE;
 static char *required_atleast_version = NULL;
 static char *required_exact_version = NULL;
 static char *required_max_version = NULL;
 static char *required_pkgconfig_version = NULL;
+static char *depfile = NULL;
+static char *depfile_target = NULL;
 static gboolean want_silence_errors = FALSE;
 static gboolean want_variable_list = FALSE;
 static gboolean want_debug_spew = FALSE;
 static gboolean want_verbose_errors = FALSE;
 static gboolean want_stdout_errors = FALSE;
 static gboolean output_opt_set = FALSE;
+static gboolean vercmp_opt_set = FALSE;
 
-void
-debug_spew (const char *format, ...)
+/* Copy of the query output for the result cache, and whether anything
+ * else was printed that a cached result couldn't reproduce.
+ */
+static GString *output = NULL;
+static gboolean diagnostics_printed = FALSE;
+
+/* Where fatal errors return to while answering a batch query */
+static jmp_buf *fatal_error_jmp = NULL;
+
+/* Errors collected for --configure-check instead of being printed */
+static GString *configure_check_errors = NULL;
+
+static void
+print_debug_spew (const char *format, va_list args)
 {
-  va_list args;
   gchar *str;
   FILE* stream;
 
-  g_return_if_fail (format != NULL);
-
   if (!want_debug_spew)
     return;
 
-  va_start (args, format);
+  diagnostics_printed = TRUE;
+
   str = g_strdup_vprintf (format, args);
-  va_end (args);
 
   if (want_stdout_errors)
     stream = stdout;
@@ -89,21 +106,24 @@ debug_spew (const char *format, ...)
   g_free (str);
 }
 
-void
-verbose_error (const char *format, ...)
+static void
+print_verbose_error (const char *format, va_list args)
 {
-  va_list args;
   gchar *str;
   FILE* stream;
   
-  g_return_if_fail (format != NULL);
+  if (configure_check_errors != NULL)
+    {
+      g_string_append_vprintf (configure_check_errors, format, args);
+      return;
+    }
 
   if (!want_verbose_errors)
     return;
 
-  va_start (args, format);
+  diagnostics_printed = TRUE;
+
   str = g_strdup_vprintf (format, args);
-  va_end (args);
 
   if (want_stdout_errors)
     stream = stdout;
@@ -116,6 +136,16 @@ verbose_error (const char *format, ...)
   g_free (str);
 }
 
+/* Give up on the current query. Outside batch mode that means exiting. */
+static void
+abandon_query (void)
+{
+  if (fatal_error_jmp != NULL)
+    longjmp (*fatal_error_jmp, 1);
+
+  exit (1);
+}
+
 static gboolean
 define_variable_cb (const char *opt, const char *arg, gpointer data,
                     GError **error)
@@ -142,9 +172,11 @@ define_variable_cb (const char *opt, const char *arg, gpointer data,
 
   if (*varval == '\0')
     {
-      fprintf (stderr, "--define-variable argument does not have a value "
-               "for the variable\n");
-      exit (1);
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "--define-variable argument does not have a value "
+                   "for the variable");
+      g_free (tmp);
+      return FALSE;
     }
 
   define_global_variable (varname, varval);
@@ -157,8 +189,6 @@ static gboolean
 output_opt_cb (const char *opt, const char *arg, gpointer data,
                GError **error)
 {
-  static gboolean vercmp_opt_set = FALSE;
-
   /* only allow one output mode, with a few exceptions */
   if (output_opt_set)
     {
@@ -191,6 +221,7 @@ output_opt_cb (const char *opt, const char *arg, gpointer data,
         {
           fprintf (stderr, "Ignoring incompatible output option \"%s\"\n",
                    opt);
+          diagnostics_printed = TRUE;
           fflush (stderr);
           return TRUE;
         }
@@ -250,6 +281,12 @@ output_opt_cb (const char *opt, const char *arg, gpointer data,
     want_requires_private = TRUE;
   else if (strcmp (opt, "--validate") == 0)
     want_validate = TRUE;
+  else if (strcmp (opt, "--rebuild-index") == 0)
+    want_rebuild_index = TRUE;
+  else if (strcmp (opt, "--configure-check") == 0)
+    want_configure_check = TRUE;
+  else if (strcmp (opt, "--print-json") == 0)
+    want_json = TRUE;
   else
     return FALSE;
 
@@ -261,30 +298,45 @@ static gboolean
 pkg_uninstalled (Package *pkg)
 {
   /* See if > 0 pkgs were uninstalled */
-  GList *tmp;
+  int i;
 
   if (pkg->uninstalled)
     return TRUE;
 
-  tmp = pkg->requires;
-  while (tmp != NULL)
+  for (i = 0; i < pkg->n_requires; i++)
     {
-      Package *pkg = tmp->data;
-
-      if (pkg_uninstalled (pkg))
+      if (pkg_uninstalled (pkg->requires[i]))
         return TRUE;
-
-      tmp = g_list_next (tmp);
     }
 
   return FALSE;
 }
 
+/* Print query output to stdout, keeping a copy if it will be stored in
+ * the result cache.
+ */
+static void
+print_output (const char *format, ...)
+{
+  va_list args;
+  gchar *str;
+
+  va_start (args, format);
+  str = g_strdup_vprintf (format, args);
+  va_end (args);
+
+  fputs (str, stdout);
+  if (output != NULL)
+    g_string_append (output, str);
+
+  g_free (str);
+}
+
 void
 print_list_data (gpointer data,
                  gpointer user_data)
 {
-  g_print ("%s\n", (gchar *)data);
+  print_output ("%s\n", (gchar *)data);
 }
 
 static void
@@ -316,16 +368,20 @@ init_pc_path (void)
 }
 
 static gboolean
-process_package_args (const char *cmdline, GList **packages, FILE *log)
+process_package_args (const char *cmdline, GList **packages,
+                      gboolean *all_found, FILE *log)
 {
   gboolean success = TRUE;
   GList *reqs;
 
+  *all_found = TRUE;
+
   reqs = parse_module_list (NULL, cmdline, "(command line arguments)");
   if (reqs == NULL)
     {
       fprintf (stderr, "Must specify package names on the command line\n");
       fflush (stderr);
+      diagnostics_printed = TRUE;
       return FALSE;
     }
 
@@ -372,6 +428,7 @@ process_package_args (const char *cmdline, GList **packages, FILE *log)
       if (req == NULL)
         {
           success = FALSE;
+          *all_found = FALSE;
           verbose_error ("No package '%s' found\n", ver->name);
           continue;
         }
@@ -465,6 +522,25 @@ static const GOptionEntry options_table[] = {
     "linking", NULL },
   { "validate", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
     &output_opt_cb, "validate a package's .pc file", NULL },
+  { "rebuild-index", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+    &output_opt_cb, "rebuild the package index in PKG_CONFIG_CACHE_DIR",
+    NULL },
+  { "depfile", 0, 0, G_OPTION_ARG_STRING, &depfile,
+    "write the .pc files and directories the answer depends on to FILE as "
+    "a Makefile rule", "FILE" },
+  { "depfile-target", 0, 0, G_OPTION_ARG_STRING, &depfile_target,
+    "name TARGET as the target of the --depfile rule", "TARGET" },
+  { "configure-check", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+    &output_opt_cb, "output whether the modules exist, their flags and any "
+    "errors as shell variable assignments", NULL },
+  { "print-json", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+    &output_opt_cb, "print the packages, their dependencies, flags and "
+    "variables as JSON", NULL },
+  { "batch", 0, 0, G_OPTION_ARG_NONE, &want_batch,
+    "answer queries read from standard input, one per line", NULL },
+  { "daemon", 0, 0, G_OPTION_ARG_NONE, &want_daemon,
+    "answer queries from other pkg-config processes on the "
+    "PKG_CONFIG_SERVER socket", NULL },
   { "define-prefix", 0, 0, G_OPTION_ARG_NONE, &define_prefix,
     "try to override the value of prefix for each .pc file found with a "
     "guesstimated value based on the location of the .pc file", NULL },
@@ -482,174 +558,319 @@ static const GOptionEntry options_table[] = {
   { NULL, 0, 0, 0, NULL, NULL, NULL }
 };
 
-int
-main (int argc, char **argv)
+static void
+print_shell_assignment (const char *name, const char *value)
 {
-  GString *str;
-  GList *packages = NULL;
-  char *search_path;
-  char *pcbuilddir;
-  gboolean need_newline;
-  FILE *log = NULL;
-  GError *error = NULL;
-  GOptionContext *opt_context;
-
-  /* This is here so that we get debug spew from the start,
-   * during arg parsing
-   */
-  if (getenv ("PKG_CONFIG_DEBUG_SPEW"))
-    {
-      want_debug_spew = TRUE;
-      want_verbose_errors = TRUE;
-      want_silence_errors = FALSE;
-      debug_spew ("PKG_CONFIG_DEBUG_SPEW variable enabling debug spew\n");
-    }
+  char *quoted = g_shell_quote (value);
 
+  print_output ("%s=%s\n", name, quoted);
+  g_free (quoted);
+}
 
-  /* Get the built-in search path */
-  init_pc_path ();
-  if (pkg_config_pc_path == NULL)
-    {
-      /* Even when we override the built-in search path, we still use it later
-       * to add pc_path to the virtual pkg-config package.
-       */
-      verbose_error ("Failed to get default search path\n");
-      exit (1);
-    }
-
-  search_path = getenv ("PKG_CONFIG_PATH");
-  if (search_path) 
-    {
-      add_search_dirs(search_path, G_SEARCHPATH_SEPARATOR_S);
-    }
-  if (getenv("PKG_CONFIG_LIBDIR") != NULL) 
+/* Answer --configure-check: everything PKG_CHECK_MODULES needs, from a
+ * single run. Errors, including fatal ones, are reported in pkg_errors
+ * rather than printed.
+ */
+static int
+configure_check (const char *modules, FILE *log)
+{
+  jmp_buf jmp;
+  jmp_buf *saved_jmp = fatal_error_jmp;
+  GList *packages = NULL;
+  gboolean all_found = FALSE;
+  volatile gboolean exists = FALSE;
+  volatile gboolean success = FALSE;
+  char * volatile cflags = NULL;
+  char * volatile libs = NULL;
+
+  configure_check_errors = g_string_new (NULL);
+  fatal_error_jmp = &jmp;
+  if (setjmp (jmp) == 0)
     {
-      add_search_dirs(getenv("PKG_CONFIG_LIBDIR"), G_SEARCHPATH_SEPARATOR_S);
+      success = process_package_args (modules, &packages, &all_found, log);
+      exists = all_found;
+      if (success)
+        {
+          cflags = packages_get_flags (packages, CFLAGS_ANY);
+          libs = packages_get_flags (packages, LIBS_ANY);
+        }
     }
   else
     {
-      add_search_dirs(pkg_config_pc_path, G_SEARCHPATH_SEPARATOR_S);
+      /* A package or one of its dependencies couldn't be loaded, or its
+       * Libs or Cflags couldn't be parsed once they were needed.
+       */
+      package_discard ();
+      success = FALSE;
     }
+  fatal_error_jmp = saved_jmp;
+
+  print_shell_assignment ("pkg_exists", exists ? "yes" : "no");
+  print_shell_assignment ("pkg_version_ok", success ? "yes" : "no");
+  print_shell_assignment ("pkg_cflags", success && cflags ? cflags : "");
+  print_shell_assignment ("pkg_libs", success && libs ? libs : "");
+  print_shell_assignment ("pkg_errors",
+                          g_strchomp (configure_check_errors->str));
+
+  g_string_free (configure_check_errors, TRUE);
+  configure_check_errors = NULL;
+  g_free (cflags);
+  g_free (libs);
+  g_list_free (packages);
+
+  return success ? 0 : 1;
+}
 
-  pcsysrootdir = getenv ("PKG_CONFIG_SYSROOT_DIR");
-  if (pcsysrootdir)
-    {
-      define_global_variable ("pc_sysrootdir", pcsysrootdir);
-    }
-  else
+static void
+append_json_string (GString *json, const char *str)
+{
+  if (str == NULL)
     {
-      define_global_variable ("pc_sysrootdir", "/");
+      g_string_append (json, "null");
+      return;
     }
 
-  pcbuilddir = getenv ("PKG_CONFIG_TOP_BUILD_DIR");
-  if (pcbuilddir)
-    {
-      define_global_variable ("pc_top_builddir", pcbuilddir);
-    }
-  else
+  g_string_append_c (json, '"');
+  for (; *str != '\0'; str++)
     {
-      /* Default appropriate for automake */
-      define_global_variable ("pc_top_builddir", "$(top_builddir)");
+      switch (*str)
+        {
+        case '"':
+          g_string_append (json, "\\\"");
+          break;
+        case '\\':
+          g_string_append (json, "\\\\");
+          break;
+        case '\n':
+          g_string_append (json, "\\n");
+          break;
+        case '\t':
+          g_string_append (json, "\\t");
+          break;
+        default:
+          if ((guchar) *str < 0x20)
+            g_string_append_printf (json, "\\u%04x", (guchar) *str);
+          else
+            g_string_append_c (json, *str);
+        }
     }
+  g_string_append_c (json, '"');
+}
 
-  if (getenv ("PKG_CONFIG_DISABLE_UNINSTALLED"))
+static void
+append_json_requires (GString *json, GList *entries)
+{
+  GList *tmp;
+
+  g_string_append_c (json, '[');
+  for (tmp = entries; tmp != NULL; tmp = g_list_next (tmp))
     {
-      debug_spew ("disabling auto-preference for uninstalled packages\n");
-      disable_uninstalled = TRUE;
+      RequiredVersion *ver = tmp->data;
+
+      g_string_append (json, "{\"name\": ");
+      append_json_string (json, ver->name);
+      if (ver->comparison != ALWAYS_MATCH)
+        {
+          g_string_append (json, ", \"comparison\": ");
+          append_json_string (json, comparison_to_str (ver->comparison));
+          g_string_append (json, ", \"version\": ");
+          append_json_string (json, ver->version);
+        }
+      g_string_append_c (json, '}');
+      if (tmp->next != NULL)
+        g_string_append (json, ", ");
     }
+  g_string_append_c (json, ']');
+}
 
-  /* Parse options */
-  opt_context = g_option_context_new (NULL);
-  g_option_context_add_main_entries (opt_context, options_table, NULL);
-  if (!g_option_context_parse(opt_context, &argc, &argv, &error))
+static const char *
+flag_type_name (FlagType type)
+{
+  switch (type)
     {
-      fprintf (stderr, "%s\n", error->message);
-      return 1;
+    case LIBS_l:
+      return "l";
+    case LIBS_L:
+      return "L";
+    case CFLAGS_I:
+      return "I";
+    default:
+      return "other";
     }
+}
 
-  /* If no output option was set, then --exists is the default. */
-  if (!output_opt_set)
+static void
+append_json_flags (GString *json, GList *flags)
+{
+  GList *tmp;
+
+  g_string_append_c (json, '[');
+  for (tmp = flags; tmp != NULL; tmp = g_list_next (tmp))
     {
-      debug_spew ("no output option set, defaulting to --exists\n");
-      want_exists = TRUE;
+      Flag *flag = tmp->data;
+
+      g_string_append (json, "{\"type\": ");
+      append_json_string (json, flag_type_name (flag->type));
+      g_string_append (json, ", \"arg\": ");
+      append_json_string (json, flag->arg);
+      g_string_append_c (json, '}');
+      if (tmp->next != NULL)
+        g_string_append (json, ", ");
     }
+  g_string_append_c (json, ']');
+}
 
-  /* Error printing is determined as follows:
-   *     - for --exists, --*-version, --list-all and no options at all,
-   *       it's off by default and --print-errors will turn it on
-   *     - for all other output options, it's on by default and
-   *       --silence-errors can turn it off
-   */
-  if (want_exists || want_list)
-    {
-      debug_spew ("Error printing disabled by default due to use of output "
-                  "options --exists, --atleast/exact/max-version, "
-                  "--list-all or no output option at all. Value of "
-                  "--print-errors: %d\n",
-                  want_verbose_errors);
+static void
+append_json_package (GString *json, Package *pkg)
+{
+  GList *keys;
+  GList *tmp;
 
-      /* Leave want_verbose_errors unchanged, reflecting --print-errors */
-    }
-  else
+  package_load_flags (pkg);
+
+  g_string_append (json, "    {\n      \"key\": ");
+  append_json_string (json, pkg->key);
+  g_string_append (json, ",\n      \"name\": ");
+  append_json_string (json, pkg->name);
+  g_string_append (json, ",\n      \"version\": ");
+  append_json_string (json, pkg->version);
+  g_string_append (json, ",\n      \"description\": ");
+  append_json_string (json, pkg->description);
+  g_string_append (json, ",\n      \"url\": ");
+  append_json_string (json, pkg->url);
+  g_string_append (json, ",\n      \"pcfiledir\": ");
+  append_json_string (json, pkg->pcfiledir);
+  g_string_append_printf (json, ",\n      \"path_position\": %d",
+                          pkg->path_position);
+  g_string_append_printf (json, ",\n      \"uninstalled\": %s",
+                          pkg->uninstalled ? "true" : "false");
+  g_string_append (json, ",\n      \"requires\": ");
+  append_json_requires (json, pkg->requires_entries);
+  g_string_append (json, ",\n      \"requires_private\": ");
+  append_json_requires (json, pkg->requires_private_entries);
+  g_string_append (json, ",\n      \"conflicts\": ");
+  append_json_requires (json, pkg->conflicts);
+  g_string_append (json, ",\n      \"cflags\": ");
+  append_json_flags (json, pkg->cflags);
+  g_string_append (json, ",\n      \"libs\": ");
+  append_json_flags (json, pkg->libs);
+
+  /* Variables are expanded, with --define-variable overrides applied */
+  g_string_append (json, ",\n      \"variables\": {");
+  keys = pkg->vars != NULL ? g_hash_table_get_keys (pkg->vars) : NULL;
+  keys = g_list_sort (keys, (GCompareFunc)g_strcmp0);
+  for (tmp = keys; tmp != NULL; tmp = g_list_next (tmp))
     {
-      debug_spew ("Error printing enabled by default due to use of output "
-                  "options besides --exists, --atleast/exact/max-version or "
-                  "--list-all. Value of --silence-errors: %d\n",
-                  want_silence_errors);
-
-      if (want_silence_errors && getenv ("PKG_CONFIG_DEBUG_SPEW") == NULL)
-        want_verbose_errors = FALSE;
-      else
-        want_verbose_errors = TRUE;
+      char *value = package_get_var (pkg, tmp->data);
+
+      append_json_string (json, tmp->data);
+      g_string_append (json, ": ");
+      append_json_string (json, value);
+      if (tmp->next != NULL)
+        g_string_append (json, ", ");
+      g_free (value);
     }
+  g_list_free (keys);
+  g_string_append (json, "}\n    }");
+}
 
-  if (want_verbose_errors)
-    debug_spew ("Error printing enabled\n");
-  else
-    debug_spew ("Error printing disabled\n");
-
-  if (want_static_lib_list)
-    enable_private_libs();
-  else
-    disable_private_libs();
+/* Add a package and everything it requires, privately or not, in the
+ * order they're first reached.
+ */
+static void
+collect_closure (Package *pkg, GHashTable *visited, GList **closure)
+{
+  int i;
 
-  /* honor Requires.private if any Cflags are requested or any static
-   * libs are requested */
+  if (g_hash_table_lookup (visited, pkg->key))
+    return;
+  g_hash_table_insert (visited, pkg->key, pkg);
+  *closure = g_list_prepend (*closure, pkg);
 
-  if (pkg_flags & CFLAGS_ANY || want_requires_private || want_exists ||
-      (want_static_lib_list && (pkg_flags & LIBS_ANY)))
-    enable_requires_private();
+  for (i = 0; i < pkg->n_requires_private; i++)
+    collect_closure (pkg->requires_private[i], visited, closure);
+}
 
-  /* ignore Requires if no Cflags or Libs are requested */
+/* Answer --print-json: the requested modules, every package they pull
+ * in and the merged flags for each output option, so that a build
+ * system can model the dependencies from a single run.
+ */
+static void
+print_json (GList *packages)
+{
+  static const struct
+  {
+    const char *name;
+    FlagType flags;
+  } merged[] = {
+    { "cflags", CFLAGS_ANY },
+    { "cflags-only-I", CFLAGS_I },
+    { "cflags-only-other", CFLAGS_OTHER },
+    { "libs", LIBS_ANY },
+    { "libs-only-l", LIBS_l },
+    { "libs-only-L", LIBS_L },
+    { "libs-only-other", LIBS_OTHER },
+    { "cflags-libs", FLAGS_ANY },
+  };
+  GString *json = g_string_new ("{\n  \"modules\": [");
+  GHashTable *visited = g_hash_table_new (NULL, NULL);
+  GList *closure = NULL;
+  GList *tmp;
+  guint i;
 
-  if (pkg_flags == 0 && !want_requires && !want_exists)
-    disable_requires();
+  for (tmp = packages; tmp != NULL; tmp = g_list_next (tmp))
+    {
+      Package *pkg = tmp->data;
 
-  /* Allow errors in .pc files when listing all. */
-  if (want_list)
-    parse_strict = FALSE;
+      append_json_string (json, pkg->key);
+      if (tmp->next != NULL)
+        g_string_append (json, ", ");
+      collect_closure (pkg, visited, &closure);
+    }
+  closure = g_list_reverse (closure);
 
-  if (want_my_version)
+  g_string_append (json, "],\n  \"flags\": {");
+  for (i = 0; i < G_N_ELEMENTS (merged); i++)
     {
-      printf ("%s\n", VERSION);
-      return 0;
+      char *flags = packages_get_flags (packages, merged[i].flags);
+
+      g_string_append (json, i == 0 ? "\n    " : ",\n    ");
+      append_json_string (json, merged[i].name);
+      g_string_append (json, ": ");
+      append_json_string (json, flags);
+      g_free (flags);
     }
 
-  if (required_pkgconfig_version)
+  g_string_append (json, "\n  },\n  \"packages\": [\n");
+  for (tmp = closure; tmp != NULL; tmp = g_list_next (tmp))
     {
-      if (compare_versions (VERSION, required_pkgconfig_version) >= 0)
-        return 0;
-      else
-        return 1;
+      append_json_package (json, tmp->data);
+      g_string_append (json, tmp->next != NULL ? ",\n" : "\n");
     }
+  g_string_append (json, "  ]\n}\n");
 
-  package_init (want_list);
+  print_output ("%s", json->str);
 
-  if (want_list)
-    {
-      print_package_list ();
-      return 0;
-    }
+  g_list_free (closure);
+  g_hash_table_destroy (visited);
+  g_string_free (json, TRUE);
+}
+
+/* Answer the query for the packages left on the command line after option
+ * parsing, returning the exit status.
+ */
+static int
+process_query (int argc, char **argv)
+{
+  GString *str;
+  GList *packages = NULL;
+  gboolean all_found;
+  gboolean need_newline;
+  FILE * volatile log = NULL;
+  jmp_buf jmp;
+  jmp_buf *saved_jmp = fatal_error_jmp;
+  volatile gboolean found = FALSE;
+  volatile gboolean abandoned = FALSE;
 
   /* Collect packages from remaining args */
   str = g_string_new ("");
@@ -662,8 +883,6 @@ main (int argc, char **argv)
       g_string_append (str, " ");
     }
 
-  g_option_context_free (opt_context);
-
   g_strstrip (str->str);
 
   if (getenv("PKG_CONFIG_LOG") != NULL)
@@ -673,24 +892,70 @@ main (int argc, char **argv)
 	{
 	  fprintf (stderr, "Cannot open log file: %s\n",
 		   getenv ("PKG_CONFIG_LOG"));
-	  exit (1);
+	  g_string_free (str, TRUE);
+	  fatal_error ();
 	}
     }
 
-  /* find and parse each of the packages specified */
-  if (!process_package_args (str->str, &packages, log))
-    return 1;
+  if (want_configure_check)
+    {
+      int ret = configure_check (str->str, log);
+
+      if (log != NULL)
+        fclose (log);
+      g_string_free (str, TRUE);
+
+      return ret;
+    }
+
+  /* find and parse each of the packages specified. Batch and daemon
+   * queries go on after a fatal error, so the log and the module list
+   * are released on the way out either way.
+   */
+  fatal_error_jmp = &jmp;
+  if (setjmp (jmp) == 0)
+    found = process_package_args (str->str, &packages, &all_found, log);
+  else
+    abandoned = TRUE;
+  fatal_error_jmp = saved_jmp;
 
   if (log != NULL)
     fclose (log);
 
   g_string_free (str, TRUE);
 
+  if (abandoned)
+    {
+      g_list_free (packages);
+      abandon_query ();
+    }
+
+  if (!found)
+    {
+      g_list_free (packages);
+      return 1;
+    }
+
+  /* Validating checks the Libs and Cflags syntax and every variable too,
+   * which are otherwise only parsed when they're used.
+   */
+  if (want_validate)
+    {
+      g_list_foreach (packages, (GFunc) package_load_flags, NULL);
+      g_list_foreach (packages, (GFunc) parse_package_variables, NULL);
+    }
+
   /* If the user just wants to check package existence or validate its .pc
    * file, we're all done. */
   if (want_exists || want_validate)
     return 0;
 
+  if (want_json)
+    {
+      print_json (packages);
+      return 0;
+    }
+
   if (want_variable_list)
     {
       GList *tmp;
@@ -707,7 +972,7 @@ main (int argc, char **argv)
               g_list_free (keys);
             }
           tmp = g_list_next (tmp);
-          if (tmp) printf ("\n");
+          if (tmp) print_output ("\n");
         }
       need_newline = FALSE;
     }
@@ -738,7 +1003,7 @@ main (int argc, char **argv)
         {
           Package *pkg = tmp->data;
 
-          printf ("%s\n", pkg->version);
+          print_output ("%s\n", pkg->version);
 
           tmp = g_list_next (tmp);
         }
@@ -756,7 +1021,7 @@ main (int argc, char **argv)
          while (*key == '/')
            key++;
          if (strlen(key) > 0)
-           printf ("%s = %s\n", key, pkg->version);
+           print_output ("%s = %s\n", key, pkg->version);
          tmp = g_list_next (tmp);
        }
    }
@@ -767,18 +1032,18 @@ main (int argc, char **argv)
       for (pkgtmp = packages; pkgtmp != NULL; pkgtmp = g_list_next (pkgtmp))
         {
           Package *pkg = pkgtmp->data;
-          GList *reqtmp;
+          int i;
 
           /* process Requires: */
-          for (reqtmp = pkg->requires; reqtmp != NULL; reqtmp = g_list_next (reqtmp))
+          for (i = 0; i < pkg->n_requires; i++)
             {
-              Package *deppkg = reqtmp->data;
+              Package *deppkg = pkg->requires[i];
               RequiredVersion *req;
               req = g_hash_table_lookup(pkg->required_versions, deppkg->key);
               if ((req == NULL) || (req->comparison == ALWAYS_MATCH))
-                printf ("%s\n", deppkg->key);
+                print_output ("%s\n", deppkg->key);
               else
-                printf ("%s %s %s\n", deppkg->key,
+                print_output ("%s %s %s\n", deppkg->key,
                   comparison_to_str(req->comparison),
                   req->version);
             }
@@ -790,22 +1055,26 @@ main (int argc, char **argv)
       for (pkgtmp = packages; pkgtmp != NULL; pkgtmp = g_list_next (pkgtmp))
         {
           Package *pkg = pkgtmp->data;
-          GList *reqtmp;
+          int n_private = pkg->n_requires_private - pkg->n_requires;
+          int i, j;
           /* process Requires.private: */
-          for (reqtmp = pkg->requires_private; reqtmp != NULL; reqtmp = g_list_next (reqtmp))
+          for (i = 0; i < n_private; i++)
             {
 
-              Package *deppkg = reqtmp->data;
+              Package *deppkg = pkg->requires_private[i];
               RequiredVersion *req;
 
-              if (g_list_find (pkg->requires, reqtmp->data))
+              for (j = 0; j < pkg->n_requires; j++)
+                if (pkg->requires[j] == deppkg)
+                  break;
+              if (j < pkg->n_requires)
                 continue;
 
               req = g_hash_table_lookup(pkg->required_versions, deppkg->key);
               if ((req == NULL) || (req->comparison == ALWAYS_MATCH))
-                printf ("%s\n", deppkg->key);
+                print_output ("%s\n", deppkg->key);
               else
-                printf ("%s %s %s\n", deppkg->key,
+                print_output ("%s %s %s\n", deppkg->key,
                   comparison_to_str(req->comparison),
                   req->version);
             }
@@ -818,7 +1087,7 @@ main (int argc, char **argv)
   if (variable_name)
     {
       char *str = packages_get_var (packages, variable_name);
-      printf ("%s", str);
+      print_output ("%s", str);
       g_free (str);
       need_newline = TRUE;
     }
@@ -826,13 +1095,535 @@ main (int argc, char **argv)
   if (pkg_flags != 0)
     {
       char *str = packages_get_flags (packages, pkg_flags);
-      printf ("%s", str);
+      print_output ("%s", str);
       g_free (str);
       need_newline = TRUE;
     }
 
   if (need_newline)
-    printf ("\n");
+    print_output ("\n");
 
   return 0;
 }
+
+static void
+define_builtin_variables (void)
+{
+  char *pcbuilddir;
+
+  pcsysrootdir = getenv ("PKG_CONFIG_SYSROOT_DIR");
+  if (pcsysrootdir)
+    {
+      define_global_variable ("pc_sysrootdir", pcsysrootdir);
+    }
+  else
+    {
+      define_global_variable ("pc_sysrootdir", "/");
+    }
+
+  pcbuilddir = getenv ("PKG_CONFIG_TOP_BUILD_DIR");
+  if (pcbuilddir)
+    {
+      define_global_variable ("pc_top_builddir", pcbuilddir);
+    }
+  else
+    {
+      /* Default appropriate for automake */
+      define_global_variable ("pc_top_builddir", "$(top_builddir)");
+    }
+}
+
+/* Parse the command line options and derive the settings they imply,
+ * leaving the package arguments in argv.
+ */
+static gboolean
+parse_options (int *argc, char ***argv)
+{
+  GError *error = NULL;
+  GOptionContext *opt_context;
+
+  opt_context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (opt_context, options_table, NULL);
+  if (!g_option_context_parse(opt_context, argc, argv, &error))
+    {
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+      g_option_context_free (opt_context);
+      return FALSE;
+    }
+  g_option_context_free (opt_context);
+
+  /* If no output option was set, then --exists is the default. */
+  if (!output_opt_set)
+    {
+      debug_spew ("no output option set, defaulting to --exists\n");
+      want_exists = TRUE;
+    }
+
+  /* Error printing is determined as follows:
+   *     - for --exists, --*-version, --list-all and no options at all,
+   *       it's off by default and --print-errors will turn it on
+   *     - for all other output options, it's on by default and
+   *       --silence-errors can turn it off
+   */
+  if (want_exists || want_list)
+    {
+      debug_spew ("Error printing disabled by default due to use of output "
+                  "options --exists, --atleast/exact/max-version, "
+                  "--list-all or no output option at all. Value of "
+                  "--print-errors: %d\n",
+                  want_verbose_errors);
+
+      /* Leave want_verbose_errors unchanged, reflecting --print-errors */
+    }
+  else
+    {
+      debug_spew ("Error printing enabled by default due to use of output "
+                  "options besides --exists, --atleast/exact/max-version or "
+                  "--list-all. Value of --silence-errors: %d\n",
+                  want_silence_errors);
+
+      if (want_silence_errors && getenv ("PKG_CONFIG_DEBUG_SPEW") == NULL)
+        want_verbose_errors = FALSE;
+      else
+        want_verbose_errors = TRUE;
+    }
+
+  if (want_verbose_errors)
+    debug_spew ("Error printing enabled\n");
+  else
+    debug_spew ("Error printing disabled\n");
+
+  if (want_static_lib_list)
+    enable_private_libs();
+  else
+    disable_private_libs();
+
+  /* honor Requires.private if any Cflags are requested or any static
+   * libs are requested */
+
+  if (pkg_flags & CFLAGS_ANY || want_requires_private || want_exists ||
+      want_configure_check || want_json ||
+      (want_static_lib_list && (pkg_flags & LIBS_ANY)))
+    enable_requires_private();
+
+  /* ignore Requires if no Cflags or Libs are requested */
+
+  if (pkg_flags == 0 && !want_requires && !want_exists &&
+      !want_configure_check && !want_json)
+    disable_requires();
+
+  /* Allow errors in .pc files when listing all. */
+  if (want_list)
+    parse_strict = FALSE;
+
+  return TRUE;
+}
+
+/* Answer a query once its options have been parsed, returning the exit
+ * status.
+ */
+static int
+run_query (int argc, char **argv)
+{
+  if (want_my_version)
+    {
+      print_output ("%s\n", VERSION);
+      return 0;
+    }
+
+  if (required_pkgconfig_version)
+    {
+      if (compare_versions (VERSION, required_pkgconfig_version) >= 0)
+        return 0;
+      else
+        return 1;
+    }
+
+  if (want_rebuild_index)
+    return rebuild_search_index () ? 0 : 1;
+
+  package_init (want_list);
+
+  if (want_list)
+    {
+      print_package_list ();
+      return 0;
+    }
+
+  return process_query (argc, argv);
+}
+
+/* Restore the option defaults before parsing a batch query */
+static void
+reset_options (void)
+{
+  want_my_version = FALSE;
+  want_version = FALSE;
+  pkg_flags = 0;
+  want_list = FALSE;
+  want_static_lib_list = ENABLE_INDIRECT_DEPS;
+  want_short_errors = FALSE;
+  want_uninstalled = FALSE;
+  g_free (variable_name);
+  variable_name = NULL;
+  want_exists = FALSE;
+  want_provides = FALSE;
+  want_requires = FALSE;
+  want_requires_private = FALSE;
+  want_validate = FALSE;
+  want_rebuild_index = FALSE;
+  want_configure_check = FALSE;
+  want_json = FALSE;
+  want_batch = FALSE;
+  want_daemon = FALSE;
+  g_free (required_atleast_version);
+  required_atleast_version = NULL;
+  g_free (required_exact_version);
+  required_exact_version = NULL;
+  g_free (required_max_version);
+  required_max_version = NULL;
+  g_free (required_pkgconfig_version);
+  required_pkgconfig_version = NULL;
+  g_free (depfile);
+  depfile = NULL;
+  g_free (depfile_target);
+  depfile_target = NULL;
+  want_variable_list = FALSE;
+  want_stdout_errors = FALSE;
+  output_opt_set = FALSE;
+  vercmp_opt_set = FALSE;
+
+  want_debug_spew = getenv ("PKG_CONFIG_DEBUG_SPEW") != NULL;
+  want_verbose_errors = want_debug_spew;
+  want_silence_errors = FALSE;
+
+  enable_requires ();
+  disable_requires_private ();
+  parse_strict = TRUE;
+  define_prefix = ENABLE_DEFINE_PREFIX;
+  prefix_variable = "prefix";
+#ifdef G_OS_WIN32
+  msvc_syntax = FALSE;
+#endif
+
+  clear_global_variables ();
+  define_builtin_variables ();
+}
+
+/* Answer a query from batch input or another process as if it were a
+ * separate pkg-config run. A fatal error abandons the query and the
+ * package table it was using, since packages may be half resolved.
+ */
+static int
+answer_query (int argc, char **argv)
+{
+  char **query_argv;
+  jmp_buf jmp;
+  int ret;
+
+  /* Option parsing rearranges the array, so hand it a copy */
+  query_argv = g_new (char *, argc + 1);
+  memcpy (query_argv, argv, (argc + 1) * sizeof (char *));
+
+  reset_options ();
+
+  fatal_error_jmp = &jmp;
+  if (setjmp (jmp) == 0)
+    {
+      if (!parse_options (&argc, &query_argv))
+        ret = 1;
+      else if (want_batch || want_daemon || depfile != NULL)
+        {
+          /* Packages read by earlier queries wouldn't be in a depfile */
+          fprintf (stderr, "--%s can't be used in a batch query\n",
+                   want_batch ? "batch" : want_daemon ? "daemon" : "depfile");
+          ret = 1;
+        }
+      else
+        ret = run_query (argc, query_argv);
+    }
+  else
+    {
+      package_discard ();
+      ret = 1;
+    }
+  fatal_error_jmp = NULL;
+
+  g_free (query_argv);
+
+  return ret;
+}
+
+static int
+batch_query (const char *line)
+{
+  char *cmdline;
+  char **args;
+  int argc;
+  GError *error = NULL;
+  int ret;
+
+  cmdline = g_strconcat ("pkg-config ", line, NULL);
+  if (!g_shell_parse_argv (cmdline, &argc, &args, &error))
+    {
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+      g_free (cmdline);
+      return 1;
+    }
+  g_free (cmdline);
+
+  ret = answer_query (argc, args);
+  g_strfreev (args);
+
+  return ret;
+}
+
+/* Read a line without its terminating newline. Returns FALSE at the end
+ * of input.
+ */
+static gboolean
+read_line (FILE *stream, GString *line)
+{
+  char buf[4096];
+
+  g_string_truncate (line, 0);
+  while (fgets (buf, sizeof (buf), stream) != NULL)
+    {
+      g_string_append (line, buf);
+      if (line->len > 0 && line->str[line->len - 1] == '\n')
+        {
+          g_string_truncate (line, line->len - 1);
+          return TRUE;
+        }
+    }
+
+  return line->len > 0;
+}
+
+/* Answer queries from stdin until it's closed. Each answer is the
+ * query's usual output followed by a NUL byte, the exit status and a
+ * newline. Parsed packages are kept across queries.
+ */
+static int
+run_batch (void)
+{
+  GString *line = g_string_new (NULL);
+
+  while (read_line (stdin, line))
+    {
+      int ret = batch_query (line->str);
+
+      fflush (stderr);
+      putchar ('\0');
+      printf ("%d\n", ret);
+      fflush (stdout);
+    }
+
+  g_string_free (line, TRUE);
+
+  return 0;
+}
+
+static void
+append_make_escaped (GString *rule, const char *path)
+{
+  for (; *path != '\0'; path++)
+    {
+      if (*path == ' ' || *path == '#')
+        g_string_append_c (rule, '\\');
+      else if (*path == '$')
+        g_string_append_c (rule, '$');
+      g_string_append_c (rule, *path);
+    }
+}
+
+/* Write a Makefile rule making the depfile target depend on every .pc
+ * file read and every search directory where a new .pc file would have
+ * changed the answer.
+ */
+static gboolean
+write_depfile (void)
+{
+  GString *rule = g_string_new (NULL);
+  GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+  GList *dirs = get_search_dirs_consulted ();
+  GList *deps;
+  GList *iter;
+  GError *error = NULL;
+  gboolean success;
+
+  append_make_escaped (rule, depfile_target);
+  g_string_append_c (rule, ':');
+
+  deps = g_list_concat (g_list_copy (get_files_read ()), dirs);
+  for (iter = deps; iter != NULL; iter = g_list_next (iter))
+    {
+      if (g_hash_table_lookup (seen, iter->data))
+        continue;
+      g_hash_table_insert (seen, iter->data, iter->data);
+
+      g_string_append (rule, " \\\n  ");
+      append_make_escaped (rule, iter->data);
+    }
+  g_string_append_c (rule, '\n');
+
+  success = g_file_set_contents (depfile, rule->str, rule->len, &error);
+  if (!success)
+    {
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+    }
+
+  g_list_free (deps);
+  g_hash_table_destroy (seen);
+  g_string_free (rule, TRUE);
+
+  return success;
+}
+
+/* Whether an option is on the command line, before it's parsed */
+static gboolean
+has_option (int argc, char **argv, const char *option)
+{
+  size_t len = strlen (option);
+  int i;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (strncmp (argv[i], option, len) == 0 &&
+          (argv[i][len] == '\0' || argv[i][len] == '='))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* --batch reads stdin and --daemon would forward to itself, so they're
+ * never handed to a server. A depfile is written relative to the
+ * client's directory.
+ */
+static gboolean
+wants_own_process (int argc, char **argv)
+{
+  return has_option (argc, argv, "--batch") ||
+    has_option (argc, argv, "--daemon") ||
+    has_option (argc, argv, "--depfile");
+}
+
+int
+main (int argc, char **argv)
+{
+  char *search_path;
+  char *result_key = NULL;
+  int ret;
+
+  set_message_handlers (print_debug_spew, print_verbose_error,
+                        abandon_query);
+
+  /* Let a running server answer the query if there is one */
+  if (getenv ("PKG_CONFIG_SERVER") != NULL && !wants_own_process (argc, argv))
+    {
+      ret = server_forward (argc, argv);
+      if (ret >= 0)
+        return ret;
+    }
+
+  /* This is here so that we get debug spew from the start,
+   * during arg parsing
+   */
+  if (getenv ("PKG_CONFIG_DEBUG_SPEW"))
+    {
+      want_debug_spew = TRUE;
+      want_verbose_errors = TRUE;
+      want_silence_errors = FALSE;
+      debug_spew ("PKG_CONFIG_DEBUG_SPEW variable enabling debug spew\n");
+    }
+
+
+  /* Get the built-in search path */
+  init_pc_path ();
+  if (pkg_config_pc_path == NULL)
+    {
+      /* Even when we override the built-in search path, we still use it later
+       * to add pc_path to the virtual pkg-config package.
+       */
+      verbose_error ("Failed to get default search path\n");
+      exit (1);
+    }
+
+  /* Replay the output of an identical earlier query if possible. A
+   * replay wouldn't write the depfile.
+   */
+  if (result_cache_enabled () && !has_option (argc, argv, "--depfile"))
+    {
+      GString *cached = g_string_new (NULL);
+
+      result_key = result_cache_key (argc, argv);
+      if (result_cache_lookup (result_key, cached, &ret))
+        {
+          fwrite (cached->str, 1, cached->len, stdout);
+          return ret;
+        }
+      g_string_free (cached, TRUE);
+      output = g_string_new (NULL);
+    }
+
+  search_path = getenv ("PKG_CONFIG_PATH");
+  if (search_path) 
+    {
+      add_search_dirs(search_path, G_SEARCHPATH_SEPARATOR_S);
+    }
+  if (getenv("PKG_CONFIG_LIBDIR") != NULL) 
+    {
+      add_search_dirs(getenv("PKG_CONFIG_LIBDIR"), G_SEARCHPATH_SEPARATOR_S);
+    }
+  else
+    {
+      add_search_dirs(pkg_config_pc_path, G_SEARCHPATH_SEPARATOR_S);
+    }
+
+  define_builtin_variables ();
+
+  if (getenv ("PKG_CONFIG_DISABLE_UNINSTALLED"))
+    {
+      debug_spew ("disabling auto-preference for uninstalled packages\n");
+      disable_uninstalled = TRUE;
+    }
+
+  if (!parse_options (&argc, &argv))
+    return 1;
+
+  if ((depfile == NULL) != (depfile_target == NULL))
+    {
+      fprintf (stderr, "--depfile and --depfile-target must be given "
+               "together\n");
+      return 1;
+    }
+
+  if (want_batch || want_daemon)
+    {
+      if (output != NULL)
+        {
+          g_string_free (output, TRUE);
+          output = NULL;
+        }
+      if (want_daemon)
+        return server_run (get_search_dirs (), answer_query);
+      return run_batch ();
+    }
+
+  ret = run_query (argc, argv);
+
+  if (depfile != NULL && !write_depfile ())
+    ret = 1;
+
+  /* --list-all prints directly and --rebuild-index has side effects */
+  if (result_key != NULL && !diagnostics_printed && !want_list &&
+      !want_rebuild_index)
+    result_cache_store (result_key, output->str, ret, get_search_dirs (),
+                        get_files_read ());
+
+  return ret;
+}
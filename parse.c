@@ -33,6 +33,11 @@
 #include <sys/wait.h>
 #endif
 #include <sys/types.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 gboolean parse_strict = TRUE;
 gboolean define_prefix = ENABLE_DEFINE_PREFIX;
@@ -42,100 +47,119 @@ char *prefix_variable = "prefix";
 gboolean msvc_syntax = FALSE;
 #endif
 
+/* Find the first '#', '\\' or '\n' from p, or end if there is none.
+ * With SSE2, 16 bytes are checked at a time.
+ */
+static const char *
+find_line_special (const char *p, const char *end)
+{
+#ifdef __SSE2__
+  const __m128i hash = _mm_set1_epi8 ('#');
+  const __m128i backslash = _mm_set1_epi8 ('\\');
+  const __m128i newline = _mm_set1_epi8 ('\n');
+
+  while (end - p >= 16)
+    {
+      __m128i chunk = _mm_loadu_si128 ((const __m128i *) p);
+      __m128i special;
+      int mask;
+
+      special = _mm_or_si128 (_mm_cmpeq_epi8 (chunk, hash),
+                              _mm_cmpeq_epi8 (chunk, backslash));
+      special = _mm_or_si128 (special, _mm_cmpeq_epi8 (chunk, newline));
+      mask = _mm_movemask_epi8 (special);
+      if (mask != 0)
+        return p + __builtin_ctz (mask);
+      p += 16;
+    }
+#endif
+
+  while (p < end && *p != '#' && *p != '\\' && *p != '\n')
+    p++;
+
+  return p;
+}
+
 /**
- * Read an entire line from a file into a buffer. Lines may
- * be delimited with '\n', '\r', '\n\r', or '\r\n'. The delimiter
- * is not written into the buffer. Text after a '#' character is treated as
- * a comment and skipped. '\' can be used to escape a # character.
- * '\' proceding a line delimiter combines adjacent lines. A '\' proceding
- * any other character is ignored and written into the output buffer
- * unmodified.
- * 
- * Return value: %FALSE if the stream was already at an EOF character.
+ * Read an entire line from a buffer holding a whole file, advancing *bufp
+ * past it. Lines may be delimited with '\n', '\r', '\n\r', or '\r\n'.
+ * The delimiter is not written into the buffer. Text after a '#'
+ * character is treated as a comment and skipped. '\' can be used to
+ * escape a # character. '\' proceding a line delimiter combines adjacent
+ * lines. A '\' proceding any other character is ignored and written into
+ * the output buffer unmodified.
+ *
+ * Runs of ordinary characters are copied at once rather than character
+ * by character.
+ *
+ * Return value: %FALSE if the buffer was already at its end.
  **/
-static gboolean
-read_one_line (FILE *stream, GString *str)
+gboolean
+read_one_line (const char **bufp, const char *end, GString *str)
 {
-  gboolean quoted = FALSE;
-  gboolean comment = FALSE;
-  int n_read = 0;
+  const char *p = *bufp;
 
   g_string_truncate (str, 0);
-  
-  while (1)
+
+  if (p == end)
+    return FALSE;
+
+  while (p < end)
     {
-      int c;
-      
-      c = getc (stream);
+      const char *run = p;
 
-      if (c == EOF)
-	{
-	  if (quoted)
-	    g_string_append_c (str, '\\');
-	  
-	  goto done;
-	}
-      else
-	n_read++;
+      p = find_line_special (p, end);
+      g_string_append_len (str, run, p - run);
 
-      if (quoted)
-	{
-	  quoted = FALSE;
-	  
-	  switch (c)
-	    {
-	    case '#':
-	      g_string_append_c (str, '#');
-	      break;
-	    case '\r':
-	    case '\n':
-	      {
-		int next_c = getc (stream);
-
-		if (!(c == EOF ||
-		      (c == '\r' && next_c == '\n') ||
-		      (c == '\n' && next_c == '\r')))
-		  ungetc (next_c, stream);
-		
-		break;
-	      }
-	    default:
-	      g_string_append_c (str, '\\');	      
-	      g_string_append_c (str, c);
-	    }
-	}
-      else
-	{
-	  switch (c)
-	    {
-	    case '#':
-	      comment = TRUE;
-	      break;
-	    case '\\':
-	      if (!comment)
-		quoted = TRUE;
-	      break;
-	    case '\n':
-	      {
-		int next_c = getc (stream);
-
-		if (!(c == EOF ||
-		      (c == '\r' && next_c == '\n') ||
-		      (c == '\n' && next_c == '\r')))
-		  ungetc (next_c, stream);
-
-		goto done;
-	      }
-	    default:
-	      if (!comment)
-		g_string_append_c (str, c);
-	    }
-	}
+      if (p == end)
+        break;
+
+      switch (*p)
+        {
+        case '#':
+          /* skip the comment, escapes included, up to the newline */
+          p = memchr (p, '\n', end - p);
+          if (p == NULL)
+            p = end;
+          break;
+
+        case '\\':
+          p++;
+          if (p == end)
+            g_string_append_c (str, '\\');
+          else if (*p == '#')
+            {
+              g_string_append_c (str, '#');
+              p++;
+            }
+          else if (*p == '\r' || *p == '\n')
+            {
+              char c = *p++;
+
+              if (p < end &&
+                  ((c == '\r' && *p == '\n') || (c == '\n' && *p == '\r')))
+                p++;
+            }
+          else
+            {
+              g_string_append_c (str, '\\');
+              g_string_append_c (str, *p);
+              p++;
+            }
+          break;
+
+        case '\n':
+          p++;
+          if (p < end && *p == '\r')
+            p++;
+          goto done;
+        }
     }
 
  done:
+  *bufp = p;
 
-  return n_read > 0;
+  return TRUE;
 }
 
 static char *
@@ -155,8 +179,11 @@ trim_string (const char *str)
   return g_strndup (str, len);
 }
 
+/* Trim a value and substitute the variables in it, seeing only the
+ * package's variables defined before position limit.
+ */
 static char *
-trim_and_sub (Package *pkg, const char *str, const char *path)
+expand_value (Package *pkg, const char *str, const char *path, int limit)
 {
   char *trimmed;
   GString *subst;
@@ -182,7 +209,7 @@ trim_and_sub (Package *pkg, const char *str, const char *path)
           /* variable */
           char *var_start;
           char *varname;
-          char *varval;
+          const char *varval;
           
           var_start = &p[2];
 
@@ -194,20 +221,26 @@ trim_and_sub (Package *pkg, const char *str, const char *path)
 
           ++p; /* past brace */
           
-          varval = package_get_var (pkg, varname);
+          varval = package_get_override (pkg, varname);
+          if (varval == NULL && pkg->vars != NULL)
+            {
+              Variable *variable = g_hash_table_lookup (pkg->vars, varname);
+
+              if (variable != NULL && variable->position < limit)
+                varval = parse_variable_value (pkg, variable);
+            }
           
           if (varval == NULL)
             {
               verbose_error ("Variable '%s' not defined in '%s'\n",
                              varname, path);
               if (parse_strict)
-                exit (1);
+                fatal_error ();
             }
 
           g_free (varname);
 
           g_string_append (subst, varval);
-          g_free (varval);
         }
       else
         {
@@ -224,6 +257,70 @@ trim_and_sub (Package *pkg, const char *str, const char *path)
   return p;
 }
 
+static char *
+trim_and_sub (Package *pkg, const char *str, const char *path)
+{
+  return expand_value (pkg, str, path, G_MAXINT);
+}
+
+/* Move a string allocated on its own into the package */
+static char *
+keep_string (Package *pkg, char *str)
+{
+  char *kept = package_strdup (pkg, str);
+
+  g_free (str);
+
+  return kept;
+}
+
+/* The value of a package's variable, expanded on first use */
+const char *
+parse_variable_value (Package *pkg, Variable *variable)
+{
+  if (!variable->expanded)
+    {
+      char *expanded = expand_value (pkg, variable->value, pkg->path,
+                                     variable->position);
+
+      variable->value = keep_string (pkg, expanded);
+      variable->expanded = TRUE;
+    }
+
+  return variable->value;
+}
+
+/* Expand all of a package's variables, in the order they were defined
+ * so that errors come out as they would have while parsing.
+ */
+void
+parse_package_variables (Package *pkg)
+{
+  GHashTableIter iter;
+  gpointer value;
+  Variable **variables;
+  guint n_variables;
+  guint i;
+
+  if (pkg->vars == NULL)
+    return;
+
+  n_variables = g_hash_table_size (pkg->vars);
+  variables = g_new (Variable *, n_variables);
+  g_hash_table_iter_init (&iter, pkg->vars);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      Variable *variable = value;
+
+      variables[variable->position] = variable;
+    }
+
+  for (i = 0; i < n_variables; i++)
+    parse_variable_value (pkg, variables[i]);
+
+  g_free (variables);
+}
+
 static void
 parse_name (Package *pkg, const char *str, const char *path)
 {
@@ -231,12 +328,12 @@ parse_name (Package *pkg, const char *str, const char *path)
     {
       verbose_error ("Name field occurs twice in '%s'\n", path);
       if (parse_strict)
-        exit (1);
+        fatal_error ();
       else
         return;
     }
   
-  pkg->name = trim_and_sub (pkg, str, path);
+  pkg->name = keep_string (pkg, trim_and_sub (pkg, str, path));
 }
 
 static void
@@ -246,12 +343,12 @@ parse_version (Package *pkg, const char *str, const char *path)
     {
       verbose_error ("Version field occurs twice in '%s'\n", path);
       if (parse_strict)
-        exit (1);
+        fatal_error ();
       else
         return;
     }
   
-  pkg->version = trim_and_sub (pkg, str, path);
+  pkg->version = keep_string (pkg, trim_and_sub (pkg, str, path));
 }
 
 static void
@@ -261,12 +358,12 @@ parse_description (Package *pkg, const char *str, const char *path)
     {
       verbose_error ("Description field occurs twice in '%s'\n", path);
       if (parse_strict)
-        exit (1);
+        fatal_error ();
       else
         return;
     }
   
-  pkg->description = trim_and_sub (pkg, str, path);
+  pkg->description = keep_string (pkg, trim_and_sub (pkg, str, path));
 }
 
 
@@ -409,6 +506,13 @@ split_module_list (const char *str, const char *path)
 
 GList *
 parse_module_list (Package *pkg, const char *str, const char *path)
+{
+  return parse_module_list_full (pkg, str, path, parse_strict);
+}
+
+GList *
+parse_module_list_full (Package *pkg, const char *str, const char *path,
+                        gboolean strict)
 {
   GList *split;
   GList *iter;
@@ -424,7 +528,7 @@ parse_module_list (Package *pkg, const char *str, const char *path)
       
       p = iter->data;
 
-      ver = g_new0 (RequiredVersion, 1);
+      ver = package_alloc (pkg, sizeof (RequiredVersion));
       ver->comparison = ALWAYS_MATCH;
       ver->owner = pkg;
       retval = g_list_prepend (retval, ver);
@@ -446,13 +550,13 @@ parse_module_list (Package *pkg, const char *str, const char *path)
       if (*start == '\0')
         {
           verbose_error ("Empty package name in Requires or Conflicts in file '%s'\n", path);
-          if (parse_strict)
-            exit (1);
+          if (strict)
+            fatal_error ();
           else
             continue;
         }
       
-      ver->name = g_strdup (start);
+      ver->name = package_strdup (pkg, start);
 
       start = p;
 
@@ -484,8 +588,8 @@ parse_module_list (Package *pkg, const char *str, const char *path)
               verbose_error ("Unknown version comparison operator '%s' after "
                              "package name '%s' in file '%s'\n", start,
                              ver->name, path);
-              if (parse_strict)
-                exit (1);
+              if (strict)
+                fatal_error ();
               else
                 continue;
             }
@@ -506,18 +610,18 @@ parse_module_list (Package *pkg, const char *str, const char *path)
         {
           verbose_error ("Comparison operator but no version after package "
                          "name '%s' in file '%s'\n", ver->name, path);
-          if (parse_strict)
-            exit (1);
+          if (strict)
+            fatal_error ();
           else
             {
-              ver->version = g_strdup ("0");
+              ver->version = package_strdup (pkg, "0");
               continue;
             }
         }
 
       if (*start != '\0')
         {
-          ver->version = g_strdup (start);
+          ver->version = package_strdup (pkg, start);
         }
 
       g_assert (ver->name);
@@ -540,7 +644,7 @@ parse_requires (Package *pkg, const char *str, const char *path)
     {
       verbose_error ("Requires field occurs twice in '%s'\n", path);
       if (parse_strict)
-        exit (1);
+        fatal_error ();
       else
         return;
     }
@@ -559,7 +663,7 @@ parse_requires_private (Package *pkg, const char *str, const char *path)
     {
       verbose_error ("Requires.private field occurs twice in '%s'\n", path);
       if (parse_strict)
-        exit (1);
+        fatal_error ();
       else
         return;
     }
@@ -578,7 +682,7 @@ parse_conflicts (Package *pkg, const char *str, const char *path)
     {
       verbose_error ("Conflicts field occurs twice in '%s'\n", path);
       if (parse_strict)
-        exit (1);
+        fatal_error ();
       else
         return;
     }
@@ -588,38 +692,275 @@ parse_conflicts (Package *pkg, const char *str, const char *path)
   g_free (trimmed);
 }
 
+/* Characters a shell treats specially, which get escaped by a
+ * backslash. Everything but letters, digits and $()+,-./:=@^_~ is.
+ */
+static const guchar shell_special[256] =
+{
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0x00 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0x10 */
+  1, 1, 1, 1, 0, 1, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0,  /* 0x20 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 1, 1,  /* 0x30 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0x40 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 0, 0,  /* 0x50 */
+  1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0x60 */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 0, 1,  /* 0x70 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0x80 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0x90 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0xa0 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0xb0 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0xc0 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0xd0 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0xe0 */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  /* 0xf0 */
+};
+
+#ifdef __SSE2__
+/* Mark the bytes of a 16 byte chunk that shell_special[] flags */
+static int
+shell_special_mask (__m128i chunk)
+{
+#define IN_RANGE(lo, hi) \
+  _mm_and_si128 (_mm_cmpgt_epi8 (chunk, _mm_set1_epi8 ((lo) - 1)), \
+                 _mm_cmplt_epi8 (chunk, _mm_set1_epi8 ((hi) + 1)))
+#define EQUALS(c) _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 (c))
+  __m128i safe;
+
+  /* Bytes above 0x7f compare as negative, so no range takes them */
+  safe = _mm_or_si128 (IN_RANGE ('+', ':'), IN_RANGE ('@', 'Z'));
+  safe = _mm_or_si128 (safe, IN_RANGE ('a', 'z'));
+  safe = _mm_or_si128 (safe, IN_RANGE ('(', ')'));
+  safe = _mm_or_si128 (safe, IN_RANGE ('^', '_'));
+  safe = _mm_or_si128 (safe, EQUALS ('$'));
+  safe = _mm_or_si128 (safe, EQUALS ('='));
+  safe = _mm_or_si128 (safe, EQUALS ('~'));
+
+  return ~_mm_movemask_epi8 (safe) & 0xffff;
+#undef IN_RANGE
+#undef EQUALS
+}
+#endif
+
+/* Count the characters of s that need escaping. With SSE2, 16 bytes
+ * are classified at a time.
+ */
+static gsize
+count_shell_special (const char *s, gsize len)
+{
+  const guchar *p = (const guchar *) s;
+  const guchar *end = p + len;
+  gsize count = 0;
+
+#ifdef __SSE2__
+  while (end - p >= 16)
+    {
+      int mask = shell_special_mask (_mm_loadu_si128 ((const __m128i *) p));
+
+      count += __builtin_popcount (mask);
+      p += 16;
+    }
+#endif
+
+  for (; p < end; p++)
+    count += shell_special[*p];
+
+  return count;
+}
+
+/* Copy s to dest, which must have room for the escaped characters too */
+static void
+escape_shell_copy (char *dest, const char *s, gsize len)
+{
+  const guchar *p = (const guchar *) s;
+  const guchar *end = p + len;
+
+  for (; p < end; p++)
+    {
+      if (shell_special[*p])
+        *dest++ = '\\';
+      *dest++ = *p;
+    }
+}
+
+/* Append s to out with every character a shell treats specially
+ * escaped by a backslash. The escaped length is counted first, so out
+ * grows at most once, and text without special characters is copied
+ * as it is.
+ */
+static void
+escape_shell_append (GString *out, const char *s, gsize len)
+{
+  gsize special = count_shell_special (s, len);
+  gsize pos = out->len;
+
+  if (special == 0)
+    {
+      g_string_append_len (out, s, len);
+      return;
+    }
+
+  g_string_set_size (out, pos + len + special);
+  escape_shell_copy (out->str + pos, s, len);
+}
+
 static char *strdup_escape_shell(const char *s)
 {
-	size_t r_s = strlen(s)+10, c = 0;
-	char *r = g_malloc(r_s);
-	while (s[0]) {
-		if ((s[0] < '$') ||
-		    (s[0] > '$' && s[0] < '(') ||
-		    (s[0] > ')' && s[0] < '+') ||
-		    (s[0] > ':' && s[0] < '=') ||
-		    (s[0] > '=' && s[0] < '@') ||
-		    (s[0] > 'Z' && s[0] < '^') ||
-		    (s[0] == '`') ||
-		    (s[0] > 'z' && s[0] < '~') ||
-		    (s[0] > '~')) {
-			r[c] = '\\';
-			c++;
-		}
-		r[c] = *s;
-		c++;
-		if (c+2 >= r_s) {
-			r_s *= 2;
-			r = g_realloc(r, r_s);
-		}
-		s++;
-	}
-	r[c] = 0;
-	return r;
+  gsize len = strlen (s);
+  gsize special = count_shell_special (s, len);
+  char *r = g_malloc (len + special + 1);
+
+  if (special == 0)
+    memcpy (r, s, len);
+  else
+    escape_shell_copy (r, s, len);
+  r[len + special] = '\0';
+
+  return r;
 }
 
-static void _do_parse_libs (Package *pkg, int argc, char **argv)
+/* Split the next argument off a Libs or Cflags value, tokenizing and
+ * unquoting in one pass exactly as g_shell_parse_argv() does, including
+ * its comments and the cases it rejects. Returns FALSE at the end of the
+ * value, setting *failed if the quoting was bad.
+ */
+static gboolean
+next_shell_arg (const char *start, const char **cursor, GString *arg,
+                gboolean *failed)
+{
+  const char *p = *cursor;
+  gboolean have_arg = FALSE;
+
+  g_string_truncate (arg, 0);
+
+  while (*p)
+    {
+      size_t run = strcspn (p, " \t\n\\'\"#");
+
+      if (run > 0)
+        {
+          have_arg = TRUE;
+          g_string_append_len (arg, p, run);
+          p += run;
+          continue;
+        }
+
+      switch (*p)
+        {
+        case ' ':
+        case '\t':
+        case '\n':
+          p++;
+          if (have_arg)
+            goto done;
+          break;
+
+        case '\\':
+          /* a backslash-newline is dropped without starting an argument */
+          if (p[1] == '\0')
+            goto bad_quoting;
+          if (p[1] != '\n')
+            {
+              have_arg = TRUE;
+              g_string_append_c (arg, p[1]);
+            }
+          p += 2;
+          break;
+
+        case '\'':
+          {
+            const char *close = strchr (p + 1, '\'');
+
+            if (close == NULL)
+              goto bad_quoting;
+            have_arg = TRUE;
+            g_string_append_len (arg, p + 1, close - p - 1);
+            p = close + 1;
+          }
+          break;
+
+        case '"':
+          have_arg = TRUE;
+          for (p++; *p != '"'; p++)
+            {
+              if (*p == '\0')
+                goto bad_quoting;
+              if (*p == '\\' && p[1] != '\0' && strchr ("\"\\`$\n", p[1]))
+                p++;
+              g_string_append_c (arg, *p);
+            }
+          p++;
+          break;
+
+        case '#':
+          /* Only a '#' starting a word after a space or newline starts a
+           * comment, which runs up to and including the next newline. A
+           * comment that's just the '#' is an error to
+           * g_shell_parse_argv().
+           */
+          if (p == start || p[-1] == ' ' || p[-1] == '\n')
+            {
+              if (p[1] == '\0')
+                goto bad_quoting;
+              p = strchr (p, '\n');
+              p = p != NULL ? p + 1 : start + strlen (start);
+              break;
+            }
+          have_arg = TRUE;
+          g_string_append_c (arg, '#');
+          p++;
+          break;
+        }
+    }
+
+ done:
+  *cursor = p;
+
+  return have_arg;
+
+ bad_quoting:
+  *failed = TRUE;
+
+  return FALSE;
+}
+
+/* Trim an argument in place, as the flags never keep surrounding
+ * whitespace.
+ */
+static void
+trim_arg (GString *arg)
+{
+  gsize skip = 0;
+  gsize len = arg->len;
+
+  while (skip < len && isspace ((guchar)arg->str[skip]))
+    skip++;
+  while (len > skip && isspace ((guchar)arg->str[len-1]))
+    len--;
+
+  g_string_truncate (arg, len);
+  g_string_erase (arg, 0, skip);
+}
+
+static Flag *
+new_flag (Package *pkg, FlagType type, GString *arg)
+{
+  Flag *flag = package_alloc (pkg, sizeof (Flag));
+
+  flag->type = type;
+  flag->arg = g_intern_string (arg->str);
+
+  return flag;
+}
+
+/* Split a Libs, Libs.private or Cflags value into classified flags and
+ * add them to the package. Each argument is unquoted, trimmed, escaped
+ * and classified as it's split, so the only copy made is the stored
+ * one.
+ */
+static gboolean
+parse_flags (Package *pkg, const char *str, int n_vars, const char *field,
+             gboolean libs)
 {
-  int i;
 #ifdef G_OS_WIN32
   char *L_flag = (msvc_syntax ? "/libpath:" : "-L");
   char *l_flag = (msvc_syntax ? "" : "-l");
@@ -629,123 +970,167 @@ static void _do_parse_libs (Package *pkg, int argc, char **argv)
   char *l_flag = "-l";
   char *lib_suffix = "";
 #endif
+  char *trimmed;
+  const char *cursor;
+  GString *arg = g_string_new (NULL);
+  GString *next = g_string_new (NULL);
+  GString *out = g_string_new (NULL);
+  GList *flags = NULL;
+  gboolean failed = FALSE;
+  gboolean have_next;
+  int argc = 0;
+
+  trimmed = expand_value (pkg, str, pkg->path, n_vars);
+  cursor = trimmed;
 
-  i = 0;
-  while (i < argc)
+  have_next = next_shell_arg (trimmed, &cursor, next, &failed);
+  while (have_next)
     {
-      Flag *flag = g_new (Flag, 1);
-      char *tmp = trim_string (argv[i]);
-      char *arg = strdup_escape_shell(tmp);
-      char *p;
-      p = arg;
-      g_free(tmp);
+      const char *p;
+      GString *tmp = arg;
+
+      arg = next;
+      next = tmp;
+      argc++;
+      have_next = next_shell_arg (trimmed, &cursor, next, &failed);
+
+      trim_arg (arg);
+      p = arg->str;
+      g_string_truncate (out, 0);
 
-      if (p[0] == '-' &&
-          p[1] == 'l' &&
-	  /* -lib: is used by the C# compiler for libs; it's not an -l
+      if (libs && p[0] == '-' && p[1] == 'l' &&
+          /* -lib: is used by the C# compiler for libs; it's not an -l
               flag. */
-	  (strncmp(p, "-lib:", 5) != 0))
+          strncmp (p, "-lib:", 5) != 0)
         {
-          p += 2;
-          while (*p && isspace ((guchar)*p))
-            ++p;
-
-          flag->type = LIBS_l;
-          flag->arg = g_strconcat (l_flag, p, lib_suffix, NULL);
-          pkg->libs = g_list_prepend (pkg->libs, flag);
+          g_string_append (out, l_flag);
+          escape_shell_append (out, p + 2, arg->len - 2);
+          g_string_append (out, lib_suffix);
+          flags = g_list_prepend (flags, new_flag (pkg, LIBS_l, out));
         }
-      else if (p[0] == '-' &&
-               p[1] == 'L')
+      else if (libs && p[0] == '-' && p[1] == 'L')
         {
-          p += 2;
-          while (*p && isspace ((guchar)*p))
-            ++p;
-
-          flag->type = LIBS_L;
-          flag->arg = g_strconcat (L_flag, p, NULL);
-          pkg->libs = g_list_prepend (pkg->libs, flag);
-	}
-      else if ((strcmp("-framework", p) == 0 ||
-                strcmp("-Wl,-framework", p) == 0) &&
-               i+1 < argc)
+          g_string_append (out, L_flag);
+          escape_shell_append (out, p + 2, arg->len - 2);
+          flags = g_list_prepend (flags, new_flag (pkg, LIBS_L, out));
+        }
+      else if (!libs && p[0] == '-' && p[1] == 'I')
+        {
+          escape_shell_append (out, p, arg->len);
+          flags = g_list_prepend (flags, new_flag (pkg, CFLAGS_I, out));
+        }
+      else if (have_next &&
+               ((libs && (strcmp ("-framework", p) == 0 ||
+                          strcmp ("-Wl,-framework", p) == 0)) ||
+                (!libs && (strcmp ("-idirafter", p) == 0 ||
+                           strcmp ("-isystem", p) == 0))))
         {
           /* Mac OS X has a -framework Foo which is really one option,
            * so we join those to avoid having -framework Foo
            * -framework Bar being changed into -framework Foo Bar
-           * later
-          */
-          gchar *framework, *tmp = trim_string (argv[i+1]);
-
-          framework = strdup_escape_shell(tmp);
-          flag->type = LIBS_OTHER;
-          flag->arg = g_strconcat (arg, " ", framework, NULL);
-          pkg->libs = g_list_prepend (pkg->libs, flag);
-          i++;
-          g_free (framework);
-          g_free (tmp);
+           * later. -idirafter and -isystem are -I flags since they
+           * control the search path.
+           */
+          escape_shell_append (out, p, arg->len);
+          g_string_append_c (out, ' ');
+          trim_arg (next);
+          escape_shell_append (out, next->str, next->len);
+          flags = g_list_prepend (flags,
+                                  new_flag (pkg, libs ? LIBS_OTHER : CFLAGS_I,
+                                            out));
+          argc++;
+          have_next = next_shell_arg (trimmed, &cursor, next, &failed);
         }
-      else if (*arg != '\0')
+      else if (arg->len > 0)
         {
-          flag->type = LIBS_OTHER;
-          flag->arg = g_strdup (arg);
-          pkg->libs = g_list_prepend (pkg->libs, flag);
+          escape_shell_append (out, p, arg->len);
+          flags = g_list_prepend (flags,
+                                  new_flag (pkg, libs ? LIBS_OTHER : CFLAGS_OTHER,
+                                            out));
         }
-      else
-        /* flag wasn't used */
-        g_free (flag);
+    }
 
-      g_free (arg);
+  g_string_free (arg, TRUE);
+  g_string_free (next, TRUE);
+  g_string_free (out, TRUE);
 
-      ++i;
+  if (failed || (argc == 0 && *trimmed != '\0'))
+    {
+      GError *error = NULL;
+      char **argv = NULL;
+
+      /* Let g_shell_parse_argv() describe the problem */
+      if (g_shell_parse_argv (trimmed, NULL, &argv, &error))
+        g_strfreev (argv);
+      verbose_error ("Couldn't parse %s field into an argument vector: %s\n",
+                     field, error ? error->message : "unknown");
+      g_clear_error (&error);
+      g_list_free (flags);
+      g_free (trimmed);
+      if (parse_strict)
+        fatal_error ();
+      else
+        return FALSE;
     }
 
+  if (libs)
+    pkg->libs = g_list_concat (flags, pkg->libs);
+  else
+    pkg->cflags = g_list_concat (flags, pkg->cflags);
+
+  g_free (trimmed);
+
+  return TRUE;
 }
 
+typedef enum
+{
+  UNPARSED_LIBS,
+  UNPARSED_LIBS_PRIVATE,
+  UNPARSED_CFLAGS
+} UnparsedField;
+
+/* A Libs, Libs.private or Cflags value kept until the flags are read,
+ * along with the number of variables it may use.
+ */
+typedef struct
+{
+  UnparsedField field;
+  char *value;
+  int n_vars;
+} UnparsedFlags;
 
 static void
-parse_libs (Package *pkg, const char *str, const char *path)
+defer_flags (Package *pkg, UnparsedField field, const char *str)
+{
+  UnparsedFlags *unparsed = package_alloc (pkg, sizeof (UnparsedFlags));
+
+  unparsed->field = field;
+  unparsed->value = package_strdup (pkg, str);
+  unparsed->n_vars = g_hash_table_size (pkg->vars);
+  pkg->unparsed_flags = g_list_append (pkg->unparsed_flags, unparsed);
+}
+
+static void
+parse_libs (Package *pkg, UnparsedFlags *unparsed)
 {
   /* Strip out -l and -L flags, put them in a separate list. */
   
-  char *trimmed;
-  char **argv = NULL;
-  int argc = 0;
-  GError *error = NULL;
-  
   if (pkg->libs_num > 0)
     {
-      verbose_error ("Libs field occurs twice in '%s'\n", path);
+      verbose_error ("Libs field occurs twice in '%s'\n", pkg->path);
       if (parse_strict)
-        exit (1);
+        fatal_error ();
       else
         return;
     }
   
-  trimmed = trim_and_sub (pkg, str, path);
-
-  if (trimmed && *trimmed &&
-      !g_shell_parse_argv (trimmed, &argc, &argv, &error))
-    {
-      verbose_error ("Couldn't parse Libs field into an argument vector: %s\n",
-                     error ? error->message : "unknown");
-      if (parse_strict)
-        exit (1);
-      else
-        {
-          g_free (trimmed);
-          return;
-        }
-    }
-
-  _do_parse_libs(pkg, argc, argv);
-
-  g_free (trimmed);
-  g_strfreev (argv);
-  pkg->libs_num++;
+  if (parse_flags (pkg, unparsed->value, unparsed->n_vars, "Libs", TRUE))
+    pkg->libs_num++;
 }
 
 static void
-parse_libs_private (Package *pkg, const char *str, const char *path)
+parse_libs_private (Package *pkg, UnparsedFlags *unparsed)
 {
   /*
     List of private libraries.  Private libraries are libraries which
@@ -759,134 +1144,36 @@ parse_libs_private (Package *pkg, const char *str, const char *path)
     a public dependency and not a private one.
   */
   
-  char *trimmed;
-  char **argv = NULL;
-  int argc = 0;
-  GError *error = NULL;
-  
   if (pkg->libs_private_num > 0)
     {
-      verbose_error ("Libs.private field occurs twice in '%s'\n", path);
+      verbose_error ("Libs.private field occurs twice in '%s'\n",
+                     pkg->path);
       if (parse_strict)
-        exit (1);
+        fatal_error ();
       else
         return;
     }
   
-  trimmed = trim_and_sub (pkg, str, path);
-
-  if (trimmed && *trimmed &&
-      !g_shell_parse_argv (trimmed, &argc, &argv, &error))
-    {
-      verbose_error ("Couldn't parse Libs.private field into an argument vector: %s\n",
-                     error ? error->message : "unknown");
-      if (parse_strict)
-        exit (1);
-      else
-        {
-          g_free (trimmed);
-          return;
-        }
-    }
-
-  _do_parse_libs(pkg, argc, argv);
-
-  g_strfreev (argv);
-  g_free (trimmed);
-
-  pkg->libs_private_num++;
+  if (parse_flags (pkg, unparsed->value, unparsed->n_vars,
+                   "Libs.private", TRUE))
+    pkg->libs_private_num++;
 }
 
 static void
-parse_cflags (Package *pkg, const char *str, const char *path)
+parse_cflags (Package *pkg, UnparsedFlags *unparsed)
 {
   /* Strip out -I flags, put them in a separate list. */
   
-  char *trimmed;
-  char **argv = NULL;
-  int argc = 0;
-  GError *error = NULL;
-  int i;
-  
   if (pkg->cflags)
     {
-      verbose_error ("Cflags field occurs twice in '%s'\n", path);
+      verbose_error ("Cflags field occurs twice in '%s'\n", pkg->path);
       if (parse_strict)
-        exit (1);
+        fatal_error ();
       else
         return;
     }
   
-  trimmed = trim_and_sub (pkg, str, path);
-
-  if (trimmed && *trimmed &&
-      !g_shell_parse_argv (trimmed, &argc, &argv, &error))
-    {
-      verbose_error ("Couldn't parse Cflags field into an argument vector: %s\n",
-                     error ? error->message : "unknown");
-      if (parse_strict)
-        exit (1);
-      else
-        {
-          g_free (trimmed);
-          return;
-        }
-    }
-
-  i = 0;
-  while (i < argc)
-    {
-      Flag *flag = g_new (Flag, 1);
-      char *tmp = trim_string (argv[i]);
-      char *arg = strdup_escape_shell(tmp);
-      char *p = arg;
-      g_free(tmp);
-
-      if (p[0] == '-' &&
-          p[1] == 'I')
-        {
-          p += 2;
-          while (*p && isspace ((guchar)*p))
-            ++p;
-
-          flag->type = CFLAGS_I;
-          flag->arg = g_strconcat ("-I", p, NULL);
-          pkg->cflags = g_list_prepend (pkg->cflags, flag);
-        }
-      else if ((strcmp ("-idirafter", arg) == 0 ||
-                strcmp ("-isystem", arg) == 0) &&
-               i+1 < argc)
-        {
-          char *option, *tmp;
-
-          tmp = trim_string (argv[i+1]);
-          option = strdup_escape_shell (tmp);
-
-          /* These are -I flags since they control the search path */
-          flag->type = CFLAGS_I;
-          flag->arg = g_strconcat (arg, " ", option, NULL);
-          pkg->cflags = g_list_prepend (pkg->cflags, flag);
-          i++;
-          g_free (option);
-          g_free (tmp);
-        }
-      else if (*arg != '\0')
-        {
-          flag->type = CFLAGS_OTHER;
-          flag->arg = g_strdup (arg);
-          pkg->cflags = g_list_prepend (pkg->cflags, flag);
-        }
-      else
-        /* flag wasn't used */
-        g_free (flag);
-
-      g_free (arg);
-      
-      ++i;
-    }
-
-  g_strfreev (argv);
-  g_free (trimmed);
+  parse_flags (pkg, unparsed->value, unparsed->n_vars, "Cflags", FALSE);
 }
 
 static void
@@ -896,32 +1183,97 @@ parse_url (Package *pkg, const char *str, const char *path)
     {
       verbose_error ("URL field occurs twice in '%s'\n", path);
       if (parse_strict)
-        exit (1);
+        fatal_error ();
       else
         return;
     }
 
-  pkg->url = trim_and_sub (pkg, str, path);
+  pkg->url = keep_string (pkg, trim_and_sub (pkg, str, path));
+}
+
+typedef enum
+{
+  KEYWORD_UNKNOWN,
+  KEYWORD_NAME,
+  KEYWORD_DESCRIPTION,
+  KEYWORD_VERSION,
+  KEYWORD_REQUIRES,
+  KEYWORD_REQUIRES_PRIVATE,
+  KEYWORD_LIBS,
+  KEYWORD_LIBS_PRIVATE,
+  KEYWORD_CFLAGS,
+  KEYWORD_CONFLICTS,
+  KEYWORD_URL
+} Keyword;
+
+/* Look a keyword up by its length and first character, so that most
+ * tags are decided by a single comparison.
+ */
+static Keyword
+lookup_keyword (const char *tag, size_t len)
+{
+#define MATCHES(keyword) (memcmp (tag, keyword, len) == 0)
+  switch (len)
+    {
+    case 3:
+      return MATCHES ("URL") ? KEYWORD_URL : KEYWORD_UNKNOWN;
+    case 4:
+      if (tag[0] == 'N')
+        return MATCHES ("Name") ? KEYWORD_NAME : KEYWORD_UNKNOWN;
+      return MATCHES ("Libs") ? KEYWORD_LIBS : KEYWORD_UNKNOWN;
+    case 6:
+      return MATCHES ("Cflags") || MATCHES ("CFlags") ?
+        KEYWORD_CFLAGS : KEYWORD_UNKNOWN;
+    case 7:
+      return MATCHES ("Version") ? KEYWORD_VERSION : KEYWORD_UNKNOWN;
+    case 8:
+      return MATCHES ("Requires") ? KEYWORD_REQUIRES : KEYWORD_UNKNOWN;
+    case 9:
+      return MATCHES ("Conflicts") ? KEYWORD_CONFLICTS : KEYWORD_UNKNOWN;
+    case 11:
+      return MATCHES ("Description") ?
+        KEYWORD_DESCRIPTION : KEYWORD_UNKNOWN;
+    case 12:
+      return MATCHES ("Libs.private") ?
+        KEYWORD_LIBS_PRIVATE : KEYWORD_UNKNOWN;
+    case 16:
+      return MATCHES ("Requires.private") ?
+        KEYWORD_REQUIRES_PRIVATE : KEYWORD_UNKNOWN;
+    default:
+      return KEYWORD_UNKNOWN;
+    }
+#undef MATCHES
 }
 
+/* Parse one logical line. The line is trimmed and split in place, so
+ * only what ends up stored in the package is allocated.
+ */
 static void
-parse_line (Package *pkg, const char *untrimmed, const char *path,
+parse_line (Package *pkg, char *line, const char *path,
 	    gboolean ignore_requires, gboolean ignore_private_libs,
-	    gboolean ignore_requires_private)
+	    gboolean ignore_requires_private, gboolean header_only)
 {
   char *str;
+  char *rewritten = NULL;
   char *p;
   char *tag;
+  char *tag_end;
+  char delimiter;
+  Keyword keyword;
+  size_t len;
 
-  debug_spew ("  line>%s\n", untrimmed);
+  debug_spew ("  line>%s\n", line);
   
-  str = trim_string (untrimmed);
+  str = line;
+  while (*str && isspace ((guchar)*str))
+    str++;
+  len = strlen (str);
+  while (len > 0 && isspace ((guchar)str[len-1]))
+    len--;
+  str[len] = '\0';
   
   if (*str == '\0') /* empty line */
-    {
-      g_free(str);
-      return;
-    }
+    return;
   
   p = str;
 
@@ -932,52 +1284,68 @@ parse_line (Package *pkg, const char *untrimmed, const char *path,
 	 *p == '_' || *p == '.')
     p++;
 
-  tag = g_strndup (str, p - str);
+  tag = str;
+  tag_end = p;
   
   while (*p && isspace ((guchar)*p))
     ++p;
 
-  if (*p == ':')
+  /* The delimiter may directly follow the tag, which is terminated in
+   * its place.
+   */
+  delimiter = *p;
+  *tag_end = '\0';
+
+  if (delimiter == ':')
     {
       /* keyword */
       ++p;
       while (*p && isspace ((guchar)*p))
         ++p;
 
-      if (strcmp (tag, "Name") == 0)
-        parse_name (pkg, p, path);
-      else if (strcmp (tag, "Description") == 0)
-        parse_description (pkg, p, path);
-      else if (strcmp (tag, "Version") == 0)
-        parse_version (pkg, p, path);
-      else if (strcmp (tag, "Requires.private") == 0)
-	{
-	  if (!ignore_requires_private)
-	    parse_requires_private (pkg, p, path);
-	}
-      else if (strcmp (tag, "Requires") == 0)
-	{
-          if (ignore_requires == FALSE)
-	    parse_requires (pkg, p, path);
-          else
-	    goto cleanup;
-        }
-      else if (strcmp (tag, "Libs.private") == 0)
+      keyword = lookup_keyword (tag, tag_end - tag);
+
+      /* A header only needs the fields --list-all prints or checks */
+      if (header_only && keyword != KEYWORD_NAME &&
+          keyword != KEYWORD_DESCRIPTION && keyword != KEYWORD_VERSION)
+        goto cleanup;
+
+      switch (keyword)
         {
+        case KEYWORD_NAME:
+          parse_name (pkg, p, path);
+          break;
+        case KEYWORD_DESCRIPTION:
+          parse_description (pkg, p, path);
+          break;
+        case KEYWORD_VERSION:
+          parse_version (pkg, p, path);
+          break;
+        case KEYWORD_REQUIRES_PRIVATE:
+          if (!ignore_requires_private)
+            parse_requires_private (pkg, p, path);
+          break;
+        case KEYWORD_REQUIRES:
+          if (ignore_requires == FALSE)
+            parse_requires (pkg, p, path);
+          break;
+        case KEYWORD_LIBS_PRIVATE:
           if (!ignore_private_libs)
-            parse_libs_private (pkg, p, path);
-        }
-      else if (strcmp (tag, "Libs") == 0)
-        parse_libs (pkg, p, path);
-      else if (strcmp (tag, "Cflags") == 0 ||
-               strcmp (tag, "CFlags") == 0)
-        parse_cflags (pkg, p, path);
-      else if (strcmp (tag, "Conflicts") == 0)
-        parse_conflicts (pkg, p, path);
-      else if (strcmp (tag, "URL") == 0)
-        parse_url (pkg, p, path);
-      else
-        {
+            defer_flags (pkg, UNPARSED_LIBS_PRIVATE, p);
+          break;
+        case KEYWORD_LIBS:
+          defer_flags (pkg, UNPARSED_LIBS, p);
+          break;
+        case KEYWORD_CFLAGS:
+          defer_flags (pkg, UNPARSED_CFLAGS, p);
+          break;
+        case KEYWORD_CONFLICTS:
+          parse_conflicts (pkg, p, path);
+          break;
+        case KEYWORD_URL:
+          parse_url (pkg, p, path);
+          break;
+        case KEYWORD_UNKNOWN:
 	  /* we don't error out on unknown keywords because they may
 	   * represent additions to the .pc file format from future
 	   * versions of pkg-config.  We do make a note of them in the
@@ -985,14 +1353,12 @@ parse_line (Package *pkg, const char *untrimmed, const char *path,
 	   * files. */
           debug_spew ("Unknown keyword '%s' in '%s'\n",
 		      tag, path);
+          break;
         }
     }
-  else if (*p == '=')
+  else if (delimiter == '=')
     {
       /* variable */
-      char *varname;
-      char *varval;
-      
       ++p;
       while (*p && isspace ((guchar)*p))
         ++p;
@@ -1015,7 +1381,7 @@ parse_line (Package *pkg, const char *untrimmed, const char *path,
               gchar *prefix;
 	      
               /* Keep track of the original prefix value. */
-              pkg->orig_prefix = g_strdup (p);
+              pkg->orig_prefix = package_strdup (pkg, p);
 
               /* Get grandparent directory for new prefix. */
               q = g_path_get_dirname (pkg->pcfiledir);
@@ -1041,10 +1407,10 @@ parse_line (Package *pkg, const char *untrimmed, const char *path,
 	      prefix = strdup_escape_shell (prefix);
 	      g_free (q);
 
-	      varname = g_strdup (tag);
 	      debug_spew (" Variable declaration, '%s' overridden with '%s'\n",
 			  tag, prefix);
-	      g_hash_table_insert (pkg->vars, varname, prefix);
+	      package_set_var (pkg, package_strdup (pkg, tag),
+			       keep_string (pkg, prefix), TRUE);
 	      goto cleanup;
 	    }
 	}
@@ -1054,11 +1420,10 @@ parse_line (Package *pkg, const char *untrimmed, const char *path,
 	       strncmp (p, pkg->orig_prefix, strlen (pkg->orig_prefix)) == 0 &&
 	       G_IS_DIR_SEPARATOR (p[strlen (pkg->orig_prefix)]))
 	{
-	  char *oldstr = str;
-
-	  p = str = g_strconcat (g_hash_table_lookup (pkg->vars, prefix_variable),
-				 p + strlen (pkg->orig_prefix), NULL);
-	  g_free (oldstr);
+	  p = rewritten =
+	    g_strconcat (((Variable *) g_hash_table_lookup (pkg->vars,
+							     prefix_variable))->value,
+			 p + strlen (pkg->orig_prefix), NULL);
 	}
 
       if (g_hash_table_lookup (pkg->vars, tag))
@@ -1066,39 +1431,42 @@ parse_line (Package *pkg, const char *untrimmed, const char *path,
           verbose_error ("Duplicate definition of variable '%s' in '%s'\n",
                          tag, path);
           if (parse_strict)
-            exit (1);
+            fatal_error ();
           else
             goto cleanup;
         }
 
-      varname = g_strdup (tag);
-      varval = trim_and_sub (pkg, p, path);     
-
+      /* The value is only expanded when it's used */
       debug_spew (" Variable declaration, '%s' has value '%s'\n",
-                  varname, varval);
-      g_hash_table_insert (pkg->vars, varname, varval);
+                  tag, p);
+      package_set_var (pkg, package_strdup (pkg, tag),
+                       package_strdup (pkg, p), FALSE);
   
     }
 
  cleanup:  
-  g_free (str);
-  g_free (tag);
+  g_free (rewritten);
 }
 
-Package*
-parse_package_file (const char *key, const char *path,
-                    gboolean ignore_requires,
-                    gboolean ignore_private_libs,
-                    gboolean ignore_requires_private)
+static Package *
+parse_file (const char *key, const char *path,
+            gboolean ignore_requires,
+            gboolean ignore_private_libs,
+            gboolean ignore_requires_private,
+            gboolean header_only)
 {
-  FILE *f;
+  int fd;
+  GMappedFile *file;
+  GError *error = NULL;
+  const char *buf;
+  const char *end;
   Package *pkg;
   GString *str;
   gboolean one_line = FALSE;
   
-  f = fopen (path, "r");
+  fd = g_open (path, O_RDONLY, 0);
 
-  if (f == NULL)
+  if (fd < 0)
     {
       verbose_error ("Failed to open '%s': %s\n",
                      path, strerror (errno));
@@ -1106,35 +1474,50 @@ parse_package_file (const char *key, const char *path,
       return NULL;
     }
 
+  /* Map the whole file rather than reading it through stdio */
+  file = g_mapped_file_new_from_fd (fd, FALSE, &error);
+  g_close (fd, NULL);
+  if (file == NULL)
+    {
+      verbose_error ("Failed to read '%s': %s\n", path, error->message);
+      g_error_free (error);
+
+      return NULL;
+    }
+  buf = g_mapped_file_get_contents (file);
+  end = buf + g_mapped_file_get_length (file);
+
   debug_spew ("Parsing package file '%s'\n", path);
   
-  pkg = g_new0 (Package, 1);
-  pkg->key = g_strdup (key);
+  pkg = package_new ();
+  pkg->key = (char *) g_intern_string (key);
 
   if (path)
     {
-      pkg->pcfiledir = g_dirname (path);
+      char *dir = g_dirname (path);
+
+      pkg->pcfiledir = (char *) g_intern_string (dir);
+      g_free (dir);
     }
   else
     {
       debug_spew ("No pcfiledir determined for package\n");
-      pkg->pcfiledir = g_strdup ("???????");
+      pkg->pcfiledir = (char *) g_intern_static_string ("???????");
     }
 
-  if (pkg->vars == NULL)
-    pkg->vars = g_hash_table_new (g_str_hash, g_str_equal);
+  pkg->path = package_strdup (pkg, path);
 
   /* Variable storing directory of pc file */
-  g_hash_table_insert (pkg->vars, "pcfiledir", pkg->pcfiledir);
+  package_set_var (pkg, "pcfiledir", pkg->pcfiledir, TRUE);
 
   str = g_string_new ("");
 
-  while (read_one_line (f, str))
+  while (read_one_line (&buf, end, str))
     {
       one_line = TRUE;
       
       parse_line (pkg, str->str, path, ignore_requires, ignore_private_libs,
-		  ignore_requires_private);
+		  ignore_requires_private, header_only);
 
       g_string_truncate (str, 0);
     }
@@ -1143,12 +1526,65 @@ parse_package_file (const char *key, const char *path,
     verbose_error ("Package file '%s' appears to be empty\n",
                    path);
   g_string_free (str, TRUE);
-  fclose(f);
+  g_mapped_file_unref (file);
+
+  return pkg;
+}
+
+Package*
+parse_package_file (const char *key, const char *path,
+                    gboolean ignore_requires,
+                    gboolean ignore_private_libs,
+                    gboolean ignore_requires_private)
+{
+  return parse_file (key, path, ignore_requires, ignore_private_libs,
+                     ignore_requires_private, FALSE);
+}
+
+/* Read only the Name, Description and Version fields, for listing. The
+ * variables are still recorded so the fields can reference them, but
+ * only the ones the fields use get expanded.
+ */
+Package*
+parse_package_header (const char *key, const char *path)
+{
+  return parse_file (key, path, TRUE, TRUE, TRUE, TRUE);
+}
+
+/* Split the Libs, Libs.private and Cflags values parse_package_file()
+ * deferred into the package's flags, in the order they were written.
+ */
+void
+parse_package_flags (Package *pkg)
+{
+  GList *iter;
+
+  if (pkg->unparsed_flags == NULL)
+    return;
+
+  for (iter = pkg->unparsed_flags; iter != NULL; iter = g_list_next (iter))
+    {
+      UnparsedFlags *unparsed = iter->data;
+
+      switch (unparsed->field)
+        {
+        case UNPARSED_LIBS:
+          parse_libs (pkg, unparsed);
+          break;
+        case UNPARSED_LIBS_PRIVATE:
+          parse_libs_private (pkg, unparsed);
+          break;
+        case UNPARSED_CFLAGS:
+          parse_cflags (pkg, unparsed);
+          break;
+        }
+    }
+
+  g_list_free (pkg->unparsed_flags);
+  pkg->unparsed_flags = NULL;
 
   pkg->cflags = g_list_reverse (pkg->cflags);
   pkg->libs = g_list_reverse (pkg->libs);
-  
-  return pkg;
 }
 
 /* Parse a package variable. When the value appears to be quoted,
@@ -1156,13 +1592,14 @@ parse_package_file (const char *key, const char *path,
  * return the raw value.
  */
 char *
-parse_package_variable (Package *pkg, const char *variable)
+parse_package_variable (Package *pkg, const char *variable,
+                        GHashTable *globals)
 {
   char *value;
   char *unquoted;
   GError *error = NULL;
 
-  value = package_get_var (pkg, variable);
+  value = package_get_var_full (pkg, variable, globals);
   if (!value)
     return NULL;
 
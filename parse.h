@@ -26,10 +26,20 @@ Package *parse_package_file (const char *key, const char *path,
                              gboolean ignore_requires,
                              gboolean ignore_private_libs,
                              gboolean ignore_requires_private);
+Package *parse_package_header (const char *key, const char *path);
+void     parse_package_flags (Package *pkg);
+void     parse_package_variables (Package *pkg);
+const char *parse_variable_value (Package *pkg, Variable *variable);
 
 GList   *parse_module_list (Package *pkg, const char *str, const char *path);
+GList   *parse_module_list_full (Package *pkg, const char *str,
+                                 const char *path, gboolean strict);
 
-char    *parse_package_variable (Package *pkg, const char *variable);
+char    *parse_package_variable (Package *pkg, const char *variable,
+                                 GHashTable *globals);
+
+/* Split a buffer holding a whole .pc file into logical lines */
+gboolean read_one_line (const char **bufp, const char *end, GString *str);
 
 #endif
 
@@ -24,6 +24,8 @@
 
 #include "pkg.h"
 #include "parse.h"
+#include "index.h"
+#include "cache.h"
 #include "rpmvercmp.h"
 
 #ifdef HAVE_MALLOC_H
@@ -39,18 +41,54 @@
 #endif
 #include <stdlib.h>
 #include <ctype.h>
+#include <setjmp.h>
 
 static void verify_package (Package *pkg);
+static void verify_package_fields (Package *pkg);
 
 static GHashTable *packages = NULL;
+static GHashTable *package_tables = NULL;
+static char *packages_key = NULL;
 static GHashTable *globals = NULL;
 static GList *search_dirs = NULL;
+static GList *files_read = NULL;
+static unsigned int search_dirs_consulted = 0;
 
 gboolean disable_uninstalled = FALSE;
 gboolean ignore_requires = FALSE;
 gboolean ignore_requires_private = TRUE;
 gboolean ignore_private_libs = TRUE;
 
+char *pcsysrootdir = NULL;
+char *pkg_config_pc_path = NULL;
+
+#define SWAP(type, a, b) G_STMT_START { type tmp = a; a = b; b = tmp; } G_STMT_END
+
+/* Exchange the state kept between calls with a context's own copy */
+void
+package_state_swap (PackageState *state)
+{
+  SWAP (GHashTable *, packages, state->packages);
+  SWAP (GHashTable *, package_tables, state->package_tables);
+  SWAP (char *, packages_key, state->packages_key);
+  SWAP (GHashTable *, globals, state->globals);
+  SWAP (GList *, search_dirs, state->search_dirs);
+  SWAP (GList *, files_read, state->files_read);
+  SWAP (unsigned int, search_dirs_consulted, state->search_dirs_consulted);
+  SWAP (gboolean, disable_uninstalled, state->disable_uninstalled);
+  SWAP (gboolean, ignore_requires, state->ignore_requires);
+  SWAP (gboolean, ignore_requires_private, state->ignore_requires_private);
+  SWAP (gboolean, ignore_private_libs, state->ignore_private_libs);
+  SWAP (gboolean, parse_strict, state->parse_strict);
+  SWAP (gboolean, define_prefix, state->define_prefix);
+  SWAP (char *, prefix_variable, state->prefix_variable);
+#ifdef G_OS_WIN32
+  SWAP (gboolean, msvc_syntax, state->msvc_syntax);
+#endif
+  SWAP (char *, pcsysrootdir, state->pcsysrootdir);
+  SWAP (char *, pkg_config_pc_path, state->pkg_config_pc_path);
+}
+
 void
 add_search_dir (const char *path)
 {
@@ -78,6 +116,40 @@ add_search_dirs (const char *path, const char *separator)
       g_strfreev (search_dirs);
 }
 
+GList *
+get_search_dirs (void)
+{
+  return search_dirs;
+}
+
+/* Locations of every .pc file read so far, whether parsed or loaded from
+ * the package cache.
+ */
+GList *
+get_files_read (void)
+{
+  return files_read;
+}
+
+/* The search directories where a new .pc file could have changed what
+ * was found so far, which is every directory before one a package was
+ * found in, or all of them once a lookup failed. Free the list but not
+ * its contents.
+ */
+GList *
+get_search_dirs_consulted (void)
+{
+  GList *dirs = NULL;
+  GList *iter;
+  unsigned int i = 0;
+
+  for (iter = search_dirs; iter != NULL && i < search_dirs_consulted;
+       iter = g_list_next (iter), i++)
+    dirs = g_list_prepend (dirs, iter->data);
+
+  return g_list_reverse (dirs);
+}
+
 #ifdef G_OS_WIN32
 /* Guard against .pc file being installed with UPPER CASE name */
 # define FOLD(x) tolower(x)
@@ -118,29 +190,148 @@ name_ends_in_uninstalled (const char *str)
     return FALSE;
 }
 
-static Package *
-internal_get_package (const char *name, gboolean warn);
+/* Files whose headers are parsed at once on a thread pool when
+ * listing. Below this many files per thread, threads don't pay off.
+ */
+#define SCAN_FILES_PER_THREAD 32
 
-/* Look for .pc files in the given directory and add them into
- * locations, ignoring duplicates
+/* One .pc file to list. Messages from parsing it on a worker thread are
+ * kept, so they can be passed on in order when its package is added.
  */
+typedef struct
+{
+  char *key;
+  char *path;
+  unsigned int path_position;
+  Package *pkg;
+  GPtrArray *messages;      /* ScanMessage, or NULL if not parsed yet */
+  gboolean failed;          /* parsing hit a fatal error */
+  jmp_buf jmp;
+} ScanJob;
+
+typedef struct
+{
+  gboolean error;
+  char *text;
+} ScanMessage;
+
+static GPrivate scan_job = G_PRIVATE_INIT (NULL);
+
 static void
-scan_dir (char *dirname)
+scan_add_message (gboolean error, const char *format, va_list args)
 {
-  GDir *dir;
-  const gchar *filename;
+  ScanJob *job = g_private_get (&scan_job);
+  ScanMessage *message = g_new (ScanMessage, 1);
 
-  int dirnamelen = strlen (dirname);
-  /* Use a copy of dirname cause Win32 opendir doesn't like
-   * superfluous trailing (back)slashes in the directory name.
-   */
-  char *dirname_copy = g_strdup (dirname);
+  message->error = error;
+  message->text = g_strdup_vprintf (format, args);
+  g_ptr_array_add (job->messages, message);
+}
 
-  if (dirnamelen > 1 && dirname[dirnamelen-1] == G_DIR_SEPARATOR)
+static void
+scan_debug_spew (const char *format, va_list args)
+{
+  scan_add_message (FALSE, format, args);
+}
+
+static void
+scan_verbose_error (const char *format, va_list args)
+{
+  scan_add_message (TRUE, format, args);
+}
+
+static void
+scan_fatal_error (void)
+{
+  ScanJob *job = g_private_get (&scan_job);
+
+  job->failed = TRUE;
+  longjmp (job->jmp, 1);
+}
+
+/* Parse one file's header on a worker thread */
+static void
+scan_parse_job (gpointer data, gpointer user_data)
+{
+  ScanJob *job = data;
+
+  job->messages = g_ptr_array_new ();
+  g_private_set (&scan_job, job);
+  set_message_handlers (scan_debug_spew, scan_verbose_error,
+                        scan_fatal_error);
+
+  if (setjmp (job->jmp) == 0)
+    job->pkg = parse_package_header (job->key, job->path);
+
+  set_message_handlers (NULL, NULL, NULL);
+  g_private_set (&scan_job, NULL);
+}
+
+/* Add a package for listing, reading only the fields --list-all
+ * prints. Its requires and flags are never looked at. If the header
+ * was already parsed on a worker thread, its messages are passed on
+ * here instead.
+ */
+static void
+add_package_header (ScanJob *job)
+{
+  Package *pkg;
+
+  debug_spew ("Reading header of '%s' from file '%s'\n",
+              job->key, job->path);
+  files_read = g_list_append (files_read, g_strdup (job->path));
+
+  if (job->messages == NULL)
+    pkg = parse_package_header (job->key, job->path);
+  else
+    {
+      guint i;
+
+      for (i = 0; i < job->messages->len; i++)
+        {
+          ScanMessage *message = g_ptr_array_index (job->messages, i);
+
+          if (message->error)
+            verbose_error ("%s", message->text);
+          else
+            debug_spew ("%s", message->text);
+          g_free (message->text);
+          g_free (message);
+        }
+      g_ptr_array_free (job->messages, TRUE);
+
+      if (job->failed)
+        fatal_error ();
+      pkg = job->pkg;
+    }
+
+  if (pkg == NULL)
     {
-      dirnamelen--;
-      dirname_copy[dirnamelen] = '\0';
+      debug_spew ("Failed to parse '%s'\n", job->path);
+      return;
     }
+
+  if (strstr (job->path, "uninstalled.pc"))
+    pkg->uninstalled = TRUE;
+
+  pkg->path_position = job->path_position;
+
+  debug_spew ("Adding '%s' to list of known packages\n", pkg->key);
+  g_hash_table_insert (packages, pkg->key, pkg);
+
+  verify_package_fields (pkg);
+}
+
+/* Look for .pc files in the given directory and add them to jobs,
+ * ignoring names already found in an earlier directory
+ */
+static void
+scan_dir (char *dirname, unsigned int path_position, GPtrArray *jobs,
+          GHashTable *seen)
+{
+  GList *names;
+  GList *iter;
+
 #ifdef G_OS_WIN32
     {
       gchar *p;
@@ -157,25 +348,71 @@ scan_dir (char *dirname)
         }
     }
 #endif
-  dir = g_dir_open (dirname_copy, 0 , NULL);
-  g_free (dirname_copy);
 
-  if (!dir)
+  debug_spew ("Scanning directory '%s'\n", dirname);
+
+  names = index_dir_names (search_dirs, dirname);
+  for (iter = names; iter != NULL; iter = g_list_next (iter))
     {
-      debug_spew ("Cannot open directory '%s' in package search path: %s\n",
-                  dirname, g_strerror (errno));
-      return;
+      char *filename;
+      ScanJob *job;
+
+      if (g_hash_table_lookup (seen, iter->data))
+        continue;
+      g_hash_table_insert (seen, iter->data, iter->data);
+
+      filename = g_strconcat (iter->data, ".pc", NULL);
+      job = g_new0 (ScanJob, 1);
+      job->key = iter->data;
+      job->path = g_build_filename (dirname, filename, NULL);
+      job->path_position = path_position;
+      g_ptr_array_add (jobs, job);
+      g_free (filename);
     }
+  g_list_free (names);
+}
 
-  debug_spew ("Scanning directory '%s'\n", dirname);
+/* Add every package in the search path for listing. With enough files,
+ * their headers are parsed in parallel, then added in search path order
+ * on this thread.
+ */
+static void
+scan_dirs (void)
+{
+  GPtrArray *jobs = g_ptr_array_new ();
+  GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+  unsigned int path_position = 0;
+  int n_threads;
+  GList *iter;
+  guint i;
+
+  for (iter = search_dirs; iter != NULL; iter = g_list_next (iter))
+    scan_dir (iter->data, ++path_position, jobs, seen);
+  g_hash_table_destroy (seen);
 
-  while ((filename = g_dir_read_name(dir)))
+  n_threads = MIN (g_get_num_processors (),
+                   jobs->len / SCAN_FILES_PER_THREAD);
+  if (n_threads > 1)
     {
-      char *path = g_build_filename (dirname, filename, NULL);
-      internal_get_package (path, FALSE);
-      g_free (path);
+      GThreadPool *pool;
+
+      debug_spew ("Parsing %u files on %d threads\n", jobs->len, n_threads);
+
+      pool = g_thread_pool_new (scan_parse_job, NULL, n_threads, TRUE, NULL);
+      for (i = 0; i < jobs->len; i++)
+        g_thread_pool_push (pool, g_ptr_array_index (jobs, i), NULL);
+      g_thread_pool_free (pool, FALSE, TRUE);
     }
-  g_dir_close (dir);
+
+  for (i = 0; i < jobs->len; i++)
+    {
+      ScanJob *job = g_ptr_array_index (jobs, i);
+
+      add_package_header (job);
+      g_free (job->path);
+      g_free (job);
+    }
+  g_ptr_array_free (jobs, TRUE);
 }
 
 static Package *
@@ -183,18 +420,16 @@ add_virtual_pkgconfig_package (void)
 {
   Package *pkg = NULL;
 
-  pkg = g_new0 (Package, 1);
+  pkg = package_new ();
 
-  pkg->key = g_strdup ("pkg-config");
-  pkg->version = g_strdup (VERSION);
-  pkg->name = g_strdup ("pkg-config");
-  pkg->description = g_strdup ("pkg-config is a system for managing "
-			       "compile/link flags for libraries");
-  pkg->url = g_strdup ("http://pkg-config.freedesktop.org/");
+  pkg->key = (char *) g_intern_static_string ("pkg-config");
+  pkg->version = package_strdup (pkg, VERSION);
+  pkg->name = package_strdup (pkg, "pkg-config");
+  pkg->description = package_strdup (pkg, "pkg-config is a system for managing "
+				     "compile/link flags for libraries");
+  pkg->url = package_strdup (pkg, "http://pkg-config.freedesktop.org/");
 
-  if (pkg->vars == NULL)
-    pkg->vars = g_hash_table_new (g_str_hash, g_str_equal);
-  g_hash_table_insert (pkg->vars, "pc_path", pkg_config_pc_path);
+  package_set_var (pkg, "pc_path", pkg_config_pc_path, TRUE);
 
   debug_spew ("Adding virtual 'pkg-config' package to list of known packages\n");
   g_hash_table_insert (packages, pkg->key, pkg);
@@ -202,16 +437,57 @@ add_virtual_pkgconfig_package (void)
   return pkg;
 }
 
+/* Describe everything besides the .pc files that affects how packages
+ * are parsed and resolved, so that queries needing different settings
+ * get separate package tables. Strings are escaped and each field ends
+ * in a newline, so different settings can't give the same key. The
+ * environment is included since packages memoize the variable overrides
+ * read from it.
+ */
+static char *
+package_table_key (gboolean want_list)
+{
+  GString *str = g_string_new (NULL);
+  char *escaped = g_strescape (prefix_variable, NULL);
+
+  g_string_append_printf (str, "%d%d%d%d%d%d\n%s\n", want_list,
+                          ignore_requires, ignore_private_libs,
+                          ignore_requires_private, parse_strict,
+                          define_prefix, escaped);
+  g_free (escaped);
+#ifdef G_OS_WIN32
+  g_string_append_printf (str, "%d\n", msvc_syntax);
+#endif
+  global_variables_to_string (str);
+  environment_variables_to_string (str);
+
+  return g_string_free (str, FALSE);
+}
+
 void
 package_init (gboolean want_list)
 {
-  if (packages)
-    return;
+  char *key = package_table_key (want_list);
+  gpointer orig_key;
+  gpointer table;
+
+  if (package_tables == NULL)
+    package_tables = g_hash_table_new (g_str_hash, g_str_equal);
+
+  if (g_hash_table_lookup_extended (package_tables, key, &orig_key, &table))
+    {
+      packages_key = orig_key;
+      packages = table;
+      g_free (key);
+      return;
+    }
       
   packages = g_hash_table_new (g_str_hash, g_str_equal);
+  packages_key = key;
+  g_hash_table_insert (package_tables, key, packages);
 
   if (want_list)
-    g_list_foreach (search_dirs, (GFunc)scan_dir, NULL);
+    scan_dirs ();
   else
     /* Should not add virtual pkgconfig package when listing to be
      * compatible with old code that only listed packages from real
@@ -219,6 +495,147 @@ package_init (gboolean want_list)
     add_virtual_pkgconfig_package ();
 }
 
+/* Free packages dropped from a table. Packages a snapshot took are
+ * frozen, and stay around for the snapshot.
+ */
+static void
+free_dropped_packages (GList *dropped)
+{
+  GList *iter;
+
+  for (iter = dropped; iter != NULL; iter = g_list_next (iter))
+    {
+      Package *pkg = iter->data;
+
+      if (!pkg->frozen)
+        package_free (pkg);
+    }
+  g_list_free (dropped);
+}
+
+static void
+package_table_free (GHashTable *table)
+{
+  free_dropped_packages (g_hash_table_get_values (table));
+  g_hash_table_destroy (table);
+}
+
+/* Forget the current package table after a fatal error left it partially
+ * resolved. Later queries start over with a fresh table.
+ */
+void
+package_discard (void)
+{
+  if (packages_key == NULL)
+    return;
+
+  g_hash_table_remove (package_tables, packages_key);
+  package_table_free (packages);
+  packages = NULL;
+  packages_key = NULL;
+}
+
+static gboolean
+requires_any (Package *pkg, GHashTable *evicted)
+{
+  int i;
+
+  for (i = 0; i < pkg->n_requires_private; i++)
+    {
+      if (g_hash_table_lookup (evicted, pkg->requires_private[i]->key))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Drop a package from one table along with everything depending on it */
+static void
+package_table_invalidate (GHashTable *table, const char *key)
+{
+  GHashTable *evicted;
+  GList *dropped;
+  gboolean changed = TRUE;
+
+  dropped = g_list_prepend (NULL, g_hash_table_lookup (table, key));
+  if (dropped->data == NULL)
+    {
+      g_list_free (dropped);
+      return;
+    }
+
+  evicted = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (evicted, (gpointer) key, (gpointer) key);
+  g_hash_table_remove (table, key);
+
+  while (changed)
+    {
+      GHashTableIter iter;
+      gpointer value;
+
+      changed = FALSE;
+      g_hash_table_iter_init (&iter, table);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          Package *pkg = value;
+
+          if (requires_any (pkg, evicted))
+            {
+              debug_spew ("Dropping '%s' since a package it requires "
+                          "changed\n", pkg->key);
+              g_hash_table_insert (evicted, pkg->key, pkg->key);
+              g_hash_table_iter_remove (&iter);
+              dropped = g_list_prepend (dropped, pkg);
+              changed = TRUE;
+            }
+        }
+    }
+
+  g_hash_table_destroy (evicted);
+  free_dropped_packages (dropped);
+}
+
+/* Forget a package whose .pc file changed, and the packages depending on
+ * it, so they're read again when next needed. A NULL name forgets all
+ * packages.
+ */
+void
+package_invalidate (const char *name)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  if (package_tables == NULL)
+    return;
+
+  if (name == NULL)
+    {
+      g_hash_table_iter_init (&iter, package_tables);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        package_table_free (value);
+      g_hash_table_remove_all (package_tables);
+      packages = NULL;
+      packages_key = NULL;
+      return;
+    }
+
+  debug_spew ("Dropping package '%s' since its .pc file changed\n", name);
+
+  g_hash_table_iter_init (&iter, package_tables);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      package_table_invalidate (value, name);
+
+      /* The uninstalled version is preferred when it's around */
+      if (name_ends_in_uninstalled (name))
+        {
+          char *installed = g_strndup (name, strlen (name) - UNINSTALLED_LEN);
+          package_table_invalidate (value, installed);
+          g_free (installed);
+        }
+    }
+}
+
 static Package *
 internal_get_package (const char *name, gboolean warn)
 {
@@ -227,7 +644,10 @@ internal_get_package (const char *name, gboolean warn)
   char *location = NULL;
   unsigned int path_position = 0;
   GList *iter;
-  GList *dir_iter;
+  Package **deps;
+  int n_requires;
+  int n_private;
+  int i;
   
   pkg = g_hash_table_lookup (packages, name);
 
@@ -264,18 +684,12 @@ internal_get_package (const char *name, gboolean warn)
             }
         }
       
-      for (dir_iter = search_dirs; dir_iter != NULL;
-           dir_iter = g_list_next (dir_iter))
-        {
-          path_position++;
-          location = g_strdup_printf ("%s%c%s.pc", (char*)dir_iter->data,
-                                      G_DIR_SEPARATOR, name);
-          if (g_file_test (location, G_FILE_TEST_IS_REGULAR))
-            break;
-          g_free (location);
-          location = NULL;
-        }
+      location = index_lookup (search_dirs, name, &path_position);
 
+      if (location == NULL)
+        search_dirs_consulted = G_MAXUINT;
+      else
+        search_dirs_consulted = MAX (search_dirs_consulted, path_position);
     }
   
   if (location == NULL)
@@ -299,8 +713,29 @@ internal_get_package (const char *name, gboolean warn)
     }
 
   debug_spew ("Reading '%s' from file '%s'\n", name, location);
-  pkg = parse_package_file (key, location, ignore_requires,
-                            ignore_private_libs, ignore_requires_private);
+  files_read = g_list_append (files_read, g_strdup (location));
+
+  /* Only strict parses are cached, since anything the parser reports
+   * in that mode is fatal and never has to be replayed.
+   */
+  if (cache_directory () != NULL && parse_strict)
+    {
+      pkg = package_cache_load (key, location, ignore_requires,
+                                ignore_private_libs, ignore_requires_private);
+      if (pkg == NULL)
+        {
+          pkg = parse_package_file (key, location, ignore_requires,
+                                    ignore_private_libs,
+                                    ignore_requires_private);
+          if (pkg != NULL)
+            package_cache_store (pkg, location, ignore_requires,
+                                 ignore_private_libs,
+                                 ignore_requires_private);
+        }
+    }
+  else
+    pkg = parse_package_file (key, location, ignore_requires,
+                              ignore_private_libs, ignore_requires_private);
   g_free (key);
 
   if (pkg != NULL && strstr (location, "uninstalled.pc"))
@@ -322,7 +757,14 @@ internal_get_package (const char *name, gboolean warn)
   debug_spew ("Adding '%s' to list of known packages\n", pkg->key);
   g_hash_table_insert (packages, pkg->key, pkg);
 
+  /* The resolved Requires.private come first in the row, followed by the
+   * Requires. The row is only published once it's complete. */
+  n_requires = g_list_length (pkg->requires_entries);
+  n_private = g_list_length (pkg->requires_private_entries);
+  deps = package_alloc (pkg, (n_private + n_requires) * sizeof (Package *));
+
   /* pull in Requires packages */
+  i = n_private;
   for (iter = pkg->requires_entries; iter != NULL; iter = g_list_next (iter))
     {
       Package *req;
@@ -335,17 +777,18 @@ internal_get_package (const char *name, gboolean warn)
         {
           verbose_error ("Package '%s', required by '%s', not found\n",
                          ver->name, pkg->key);
-          exit (1);
+          fatal_error ();
         }
 
       if (pkg->required_versions == NULL)
         pkg->required_versions = g_hash_table_new (g_str_hash, g_str_equal);
 
       g_hash_table_insert (pkg->required_versions, ver->name, ver);
-      pkg->requires = g_list_prepend (pkg->requires, req);
+      deps[i++] = req;
     }
 
   /* pull in Requires.private packages */
+  i = 0;
   for (iter = pkg->requires_private_entries; iter != NULL;
        iter = g_list_next (iter))
     {
@@ -359,28 +802,49 @@ internal_get_package (const char *name, gboolean warn)
         {
           verbose_error ("Package '%s', required by '%s', not found\n",
 			 ver->name, pkg->key);
-          exit (1);
+          fatal_error ();
         }
 
       if (pkg->required_versions == NULL)
         pkg->required_versions = g_hash_table_new (g_str_hash, g_str_equal);
 
       g_hash_table_insert (pkg->required_versions, ver->name, ver);
-      pkg->requires_private = g_list_prepend (pkg->requires_private, req);
+      deps[i++] = req;
     }
 
-  /* make requires_private include a copy of the public requires too */
-  pkg->requires_private = g_list_concat (g_list_copy (pkg->requires),
-                                         pkg->requires_private);
-
-  pkg->requires = g_list_reverse (pkg->requires);
-  pkg->requires_private = g_list_reverse (pkg->requires_private);
+  /* requires_private includes the public requires too */
+  pkg->requires_private = deps;
+  pkg->n_requires_private = n_private + n_requires;
+  pkg->requires = deps + n_private;
+  pkg->n_requires = n_requires;
 
   verify_package (pkg);
 
   return pkg;
 }
 
+gboolean
+rebuild_search_index (void)
+{
+  GError *error = NULL;
+
+  if (!index_enabled ())
+    {
+      fprintf (stderr, "PKG_CONFIG_CACHE_DIR must be set to rebuild the "
+               "package index\n");
+      return FALSE;
+    }
+
+  if (!index_rebuild (search_dirs, &error))
+    {
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 Package *
 get_package (const char *name)
 {
@@ -406,7 +870,7 @@ flag_list_strip_duplicates (GList *list)
       Flag *cur = tmp->data;
       Flag *prev = tmp->prev->data;
 
-      if (cur->type == prev->type && g_strcmp0 (cur->arg, prev->arg) == 0)
+      if (cur->type == prev->type && cur->arg == prev->arg)
         {
           /* Remove the duplicate flag from the list and move to the last
            * element to prepare for the next iteration. */
@@ -422,7 +886,7 @@ flag_list_strip_duplicates (GList *list)
 }
 
 static char *
-flag_list_to_string (GList *list)
+flag_list_to_string (GList *list, const char *sysroot)
 {
   GList *tmp;
   GString *str = g_string_new ("");
@@ -431,22 +895,22 @@ flag_list_to_string (GList *list)
   tmp = list;
   while (tmp != NULL) {
     Flag *flag = tmp->data;
-    char *tmpstr = flag->arg;
+    const char *tmpstr = flag->arg;
 
-    if (pcsysrootdir != NULL && flag->type & (CFLAGS_I | LIBS_L)) {
+    if (sysroot != NULL && flag->type & (CFLAGS_I | LIBS_L)) {
       /* Handle non-I Cflags like -isystem */
       if (flag->type & CFLAGS_I && strncmp (tmpstr, "-I", 2) != 0) {
-        char *space = strchr (tmpstr, ' ');
+        const char *space = strchr (tmpstr, ' ');
 
         /* Ensure this has a separate arg */
         g_assert (space != NULL && space[1] != '\0');
         g_string_append_len (str, tmpstr, space - tmpstr + 1);
-        g_string_append (str, pcsysrootdir);
+        g_string_append (str, sysroot);
         g_string_append (str, space + 1);
       } else {
         g_string_append_c (str, '-');
         g_string_append_c (str, tmpstr[1]);
-        g_string_append (str, pcsysrootdir);
+        g_string_append (str, sysroot);
         g_string_append (str, tmpstr+2);
       }
     } else {
@@ -465,8 +929,8 @@ flag_list_to_string (GList *list)
 static int
 pathposcmp (gconstpointer a, gconstpointer b)
 {
-  const Package *pa = a;
-  const Package *pb = b;
+  const Package *pa = *(Package * const *) a;
+  const Package *pb = *(Package * const *) b;
   
   if (pa->path_position < pb->path_position)
     return -1;
@@ -478,81 +942,301 @@ pathposcmp (gconstpointer a, gconstpointer b)
 
 static void
 spew_package_list (const char *name,
-                   GList     *list)
+                   GPtrArray  *list)
 {
-  GList *tmp;
+  guint i;
 
   debug_spew (" %s:", name);
 
-  tmp = list;
-  while (tmp != NULL)
+  for (i = 0; i < list->len; i++)
     {
-      Package *pkg = tmp->data;
+      Package *pkg = g_ptr_array_index (list, i);
       debug_spew (" %s", pkg->key);
-      tmp = tmp->next;
     }
   debug_spew ("\n");
 }
 
 
-static GList *
-packages_sort_by_path_position (GList *list)
+/* The list is sorted in place. The sort is stable, so packages from the
+ * same directory keep their order.
+ */
+static void
+packages_sort_by_path_position (GPtrArray *list)
+{
+  g_ptr_array_sort (list, pathposcmp);
+}
+
+typedef struct
+{
+  Package *pkg;
+  int next; /* requirements left to visit, taken from the end */
+} ClosureFrame;
+
+/* Scratch space for packages_closure(), kept by each thread between
+ * calls. The visited bitset is indexed by package id and is all clear
+ * between calls.
+ */
+typedef struct
+{
+  guint32 *visited;
+  guint n_words;
+  GArray *stack;
+} ClosureScratch;
+
+static void
+closure_scratch_free (gpointer data)
+{
+  ClosureScratch *scratch = data;
+
+  g_free (scratch->visited);
+  g_array_free (scratch->stack, TRUE);
+  g_free (scratch);
+}
+
+static GPrivate closure_scratch = G_PRIVATE_INIT (closure_scratch_free);
+
+static ClosureScratch *
+get_closure_scratch (void)
+{
+  ClosureScratch *scratch = g_private_get (&closure_scratch);
+
+  if (scratch == NULL)
+    {
+      scratch = g_new0 (ClosureScratch, 1);
+      scratch->stack = g_array_new (FALSE, FALSE, sizeof (ClosureFrame));
+      g_private_set (&closure_scratch, scratch);
+    }
+
+  return scratch;
+}
+
+/* Mark a package visited, returning whether it already was */
+static gboolean
+closure_mark (ClosureScratch *scratch, Package *pkg)
+{
+  guint word = pkg->id / 32;
+  guint32 bit = 1u << (pkg->id % 32);
+  gboolean visited;
+
+  if (word >= scratch->n_words)
+    {
+      guint n_words = MAX (word + 1, scratch->n_words * 2);
+
+      scratch->visited = g_renew (guint32, scratch->visited, n_words);
+      memset (scratch->visited + scratch->n_words, 0,
+              (n_words - scratch->n_words) * sizeof (guint32));
+      scratch->n_words = n_words;
+    }
+
+  visited = (scratch->visited[word] & bit) != 0;
+  scratch->visited[word] |= bit;
+
+  return visited;
+}
+
+/* Mark a package visited and push it, unless it already was */
+static void
+closure_visit (ClosureScratch *scratch, Package *pkg,
+               gboolean include_private)
+{
+  ClosureFrame frame;
+
+  /*
+   * If the package has already been visited, then it is already in the
+   * result and we can skip it. Additionally, this allows circular requires
+   * loops to be broken.
+   */
+  if (closure_mark (scratch, pkg))
+    {
+      debug_spew ("Package %s already in requires chain, skipping\n",
+                  pkg->key);
+      return;
+    }
+
+  /* record this package in the dependency chain */
+  frame.pkg = pkg;
+  frame.next = include_private ? pkg->n_requires_private : pkg->n_requires;
+  g_array_append_val (scratch->stack, frame);
+}
+
+/* Reverse the packages added to 'sorted' since 'start', and clear them
+ * from the bitset for the next call.
+ */
+static void
+packages_closure_finish (ClosureScratch *scratch, GPtrArray *sorted,
+                         guint start)
+{
+  guint i, j;
+
+  for (i = start, j = sorted->len; i + 1 < j; i++, j--)
+    {
+      gpointer tmp = sorted->pdata[i];
+
+      sorted->pdata[i] = sorted->pdata[j - 1];
+      sorted->pdata[j - 1] = tmp;
+    }
+
+  /* Leave the bitset clear for the next call */
+  for (i = start; i < sorted->len; i++)
+    {
+      Package *pkg = g_ptr_array_index (sorted, i);
+
+      scratch->visited[pkg->id / 32] = 0;
+    }
+}
+
+/* Construct a topological sort of all required packages, appending it to
+ * 'sorted'.
+ *
+ * This is a depth first search starting from the right, run on an explicit
+ * stack so that long chains of requires can't exhaust the real one. Each
+ * package is added once all the packages it requires are, and the added
+ * part is reversed at the end, so the first node reached in the search
+ * ends up last. Previously visited nodes are skipped. The result lists
+ * each package once, before any package that it depends on.
+ */
+static void
+packages_closure (GList *packages, gboolean include_private,
+                  GPtrArray *sorted)
+{
+  ClosureScratch *scratch = get_closure_scratch ();
+  GArray *stack = scratch->stack;
+  guint start = sorted->len;
+  GList *tmp;
+
+  /* Start from the end of the package list to maintain order since the
+   * search adds to the front. */
+  for (tmp = g_list_last (packages); tmp != NULL; tmp = g_list_previous (tmp))
+    {
+      closure_visit (scratch, tmp->data, include_private);
+
+      while (stack->len > 0)
+        {
+          ClosureFrame *frame = &g_array_index (stack, ClosureFrame,
+                                                stack->len - 1);
+          Package *pkg = frame->pkg;
+
+          if (frame->next > 0)
+            {
+              Package **reqs = include_private ?
+                pkg->requires_private : pkg->requires;
+
+              /* Pushing may move the frame, so it's done with it first */
+              closure_visit (scratch, reqs[--frame->next], include_private);
+            }
+          else
+            {
+              g_ptr_array_add (sorted, pkg);
+              g_array_set_size (stack, stack->len - 1);
+            }
+        }
+    }
+
+  packages_closure_finish (scratch, sorted, start);
+}
+
+static Package **
+package_closure_new (Package *pkg, gboolean include_private)
+{
+  GList root = { pkg, NULL, NULL };
+  GPtrArray *sorted = g_ptr_array_new ();
+  Package **closure;
+
+  packages_closure (&root, include_private, sorted);
+  closure = package_alloc (pkg, (sorted->len + 1) * sizeof (Package *));
+  memcpy (closure, sorted->pdata, sorted->len * sizeof (Package *));
+  g_ptr_array_free (sorted, TRUE);
+
+  return closure;
+}
+
+/* Memoize the closure of a single package on it, NULL terminated. The
+ * packages it reaches must all be loaded. Frozen packages may be read
+ * by other threads, so only package_freeze() memoizes theirs.
+ */
+static void
+package_memoize_closure (Package *pkg, gboolean include_private)
 {
-  return g_list_sort (list, pathposcmp);
+  Package ***location = include_private ?
+    &pkg->closure_private : &pkg->closure;
+
+  if (g_atomic_pointer_get (location) == NULL)
+    g_atomic_pointer_set (location,
+                          package_closure_new (pkg, include_private));
 }
 
-/* Construct a topological sort of all required packages.
+/* The same as packages_closure(), built from the memoized closures of
+ * the individual packages instead of searching the graph again.
  *
- * This is a depth first search starting from the right.  The output 'listp' is
- * in reverse order, with the first node reached in the depth first search at
- * the end of the list.  Previously visited nodes are skipped.  The result is
- * a list of packages such that each packages is listed once and comes before
- * any package that it depends on.
+ * The packages reached from the packages to the right are a closed set,
+ * so the search from a package skips exactly the part of its own closure
+ * that's in that set and finds the rest in the same order. Merging the
+ * closures from the right while skipping packages already seen gives the
+ * same result as the search.
  */
 static void
-recursive_fill_list (Package *pkg, gboolean include_private,
-                     GHashTable *visited, GList **listp)
+packages_closure_memoized (GList *packages, gboolean include_private,
+                           GPtrArray *sorted)
 {
+  ClosureScratch *scratch;
+  guint start = sorted->len;
   GList *tmp;
 
-  /*
-   * If the package has already been visited, then it is already in 'listp' and
-   * we can skip it. Additionally, this allows circular requires loops to be
-   * broken.
-   */
-  if (g_hash_table_lookup_extended (visited, pkg->key, NULL, NULL))
+  for (tmp = packages; tmp != NULL; tmp = g_list_next (tmp))
     {
-      debug_spew ("Package %s already in requires chain, skipping\n",
-                  pkg->key);
-      return;
+      Package *pkg = tmp->data;
+
+      if (!pkg->frozen)
+        package_memoize_closure (pkg, include_private);
+      else if (g_atomic_pointer_get (include_private ? &pkg->closure_private
+                                                     : &pkg->closure) == NULL)
+        {
+          packages_closure (packages, include_private, sorted);
+          return;
+        }
     }
-  /* record this package in the dependency chain */
-  else
+
+  scratch = get_closure_scratch ();
+
+  /* Collect in reverse, like the search does */
+  for (tmp = g_list_last (packages); tmp != NULL; tmp = g_list_previous (tmp))
     {
-      g_hash_table_replace (visited, pkg->key, pkg->key);
-    }
+      Package *pkg = tmp->data;
+      Package **closure = g_atomic_pointer_get (include_private ?
+                                                &pkg->closure_private :
+                                                &pkg->closure);
+      int n;
+
+      for (n = 0; closure[n] != NULL; n++)
+        ;
+      while (n-- > 0)
+        {
+          Package *req = closure[n];
 
-  /* Start from the end of the required package list to maintain order since
-   * the recursive list is built by prepending. */
-  tmp = include_private ? pkg->requires_private : pkg->requires;
-  for (tmp = g_list_last (tmp); tmp != NULL; tmp = g_list_previous (tmp))
-    recursive_fill_list (tmp->data, include_private, visited, listp);
+          if (!closure_mark (scratch, req))
+            g_ptr_array_add (sorted, req);
+        }
+    }
 
-  *listp = g_list_prepend (*listp, pkg);
+  packages_closure_finish (scratch, sorted, start);
 }
 
 /* merge the flags from the individual packages */
 static GList *
-merge_flag_lists (GList *packages, FlagType type)
+merge_flag_lists (GPtrArray *packages, FlagType type)
 {
   GList *last = NULL;
   GList *merged = NULL;
+  guint i;
 
   /* keep track of the last element to avoid traversing the whole list */
-  for (; packages != NULL; packages = g_list_next (packages))
+  for (i = 0; i < packages->len; i++)
     {
-      Package *pkg = packages->data;
-      GList *flags = (type & LIBS_ANY) ? pkg->libs : pkg->cflags;
+      Package *pkg = g_ptr_array_index (packages, i);
+      GList *flags;
+
+      package_load_flags (pkg);
+      flags = (type & LIBS_ANY) ? pkg->libs : pkg->cflags;
 
       /* manually copy the elements so we can keep track of the end */
       for (; flags != NULL; flags = g_list_next (flags))
@@ -575,34 +1259,63 @@ merge_flag_lists (GList *packages, FlagType type)
   return merged;
 }
 
-static GList *
-fill_list (GList *packages, FlagType type,
-           gboolean in_path_order, gboolean include_private)
+/* The packages the flags of a query come from. Each ordering is worked
+ * out once and shared by all the flag types that need it.
+ */
+typedef struct
 {
-  GList *tmp;
-  GList *expanded = NULL;
-  GList *flags;
-  GHashTable *visited;
+  GList *packages; /* the requested packages */
+  GPtrArray *expanded[2]; /* indexed by include_private */
+  GPtrArray *in_path_order[2];
+} FlagSources;
 
-  /* Start from the end of the requested package list to maintain order since
-   * the recursive list is built by prepending. */
-  visited = g_hash_table_new (g_str_hash, g_str_equal);
-  for (tmp = g_list_last (packages); tmp != NULL; tmp = g_list_previous (tmp))
-    recursive_fill_list (tmp->data, include_private, visited, &expanded);
-  g_hash_table_destroy (visited);
-  spew_package_list ("post-recurse", expanded);
+static void
+flag_sources_free (FlagSources *sources)
+{
+  int i;
 
-  if (in_path_order)
+  for (i = 0; i < 2; i++)
     {
-      spew_package_list ("original", expanded);
-      expanded = packages_sort_by_path_position (expanded);
-      spew_package_list ("  sorted", expanded);
+      if (sources->expanded[i])
+        g_ptr_array_free (sources->expanded[i], TRUE);
+      if (sources->in_path_order[i])
+        g_ptr_array_free (sources->in_path_order[i], TRUE);
+    }
+}
+
+static GPtrArray *
+fill_list (FlagSources *sources, gboolean in_path_order,
+           gboolean include_private)
+{
+  int i = include_private ? 1 : 0;
+  GPtrArray *expanded = sources->expanded[i];
+  GPtrArray *sorted;
+
+  if (expanded == NULL)
+    {
+      expanded = sources->expanded[i] = g_ptr_array_new ();
+      packages_closure_memoized (sources->packages, include_private,
+                                 expanded);
+      spew_package_list ("post-recurse", expanded);
     }
 
-  flags = merge_flag_lists (expanded, type);
-  g_list_free (expanded);
+  if (!in_path_order)
+    return expanded;
+
+  if (sources->in_path_order[i] == NULL)
+    {
+      sorted = sources->in_path_order[i] =
+        g_ptr_array_sized_new (expanded->len);
+      g_ptr_array_set_size (sorted, expanded->len);
+      memcpy (sorted->pdata, expanded->pdata,
+              expanded->len * sizeof (gpointer));
+
+      spew_package_list ("original", sorted);
+      packages_sort_by_path_position (sorted);
+      spew_package_list ("  sorted", sorted);
+    }
 
-  return flags;
+  return sources->in_path_order[i];
 }
 
 static GList *
@@ -621,6 +1334,23 @@ add_env_variable_to_list (GList *list, const gchar *env)
   return list;
 }
 
+/* The interned flags naming each directory with the given option */
+static GList *
+intern_system_flags (GList *dirs, const char *option)
+{
+  GList *flags = NULL;
+
+  for (; dirs != NULL; dirs = g_list_next (dirs))
+    {
+      char *flag = g_strconcat (option, dirs->data, NULL);
+
+      flags = g_list_prepend (flags, (gpointer) g_intern_string (flag));
+      g_free (flag);
+    }
+
+  return g_list_reverse (flags);
+}
+
 /* Well known compiler include path environment variables. These are
  * used to find additional system include paths to remove. See
  * https://gcc.gnu.org/onlinedocs/gcc/Environment-Variables.html. */
@@ -640,59 +1370,56 @@ static const gchar *msvc_include_envvars[] = {
 };
 #endif
 
+/* Be sure we have the required fields */
 static void
-verify_package (Package *pkg)
+verify_package_fields (Package *pkg)
 {
-  GList *requires = NULL;
-  GList *conflicts = NULL;
-  GList *system_directories = NULL;
-  GList *iter;
-  GList *requires_iter;
-  GList *conflicts_iter;
-  GList *system_dir_iter = NULL;
-  GHashTable *visited;
-  int count;
-  const gchar *search_path;
-  const gchar **include_envvars;
-  const gchar **var;
-
-  /* Be sure we have the required fields */
-
   if (pkg->key == NULL)
     {
       fprintf (stderr,
                "Internal pkg-config error, package with no key, please file a bug report\n");
-      exit (1);
+      fatal_error ();
     }
   
   if (pkg->name == NULL)
     {
       verbose_error ("Package '%s' has no Name: field\n",
                      pkg->key);
-      exit (1);
+      fatal_error ();
     }
 
   if (pkg->version == NULL)
     {
       verbose_error ("Package '%s' has no Version: field\n",
                      pkg->key);
-      exit (1);
+      fatal_error ();
     }
 
   if (pkg->description == NULL)
     {
       verbose_error ("Package '%s' has no Description: field\n",
                      pkg->key);
-      exit (1);
+      fatal_error ();
     }
-  
-  /* Make sure we have the right version for all requirements */
+}
+
+static void
+verify_package (Package *pkg)
+{
+  GList root = { pkg, NULL, NULL };
+  GPtrArray *requires;
+  GList *conflicts = NULL;
+  GList *conflicts_iter;
+  guint j;
+  int i;
+
+  verify_package_fields (pkg);
 
-  iter = pkg->requires_private;
+  /* Make sure we have the right version for all requirements */
 
-  while (iter != NULL)
+  for (i = 0; i < pkg->n_requires_private; i++)
     {
-      Package *req = iter->data;
+      Package *req = pkg->requires_private[i];
       RequiredVersion *ver = NULL;
 
       if (pkg->required_versions)
@@ -713,25 +1440,21 @@ verify_package (Package *pkg)
                 verbose_error ("You may find new versions of %s at %s\n",
                                req->name, req->url);
 
-              exit (1);
+              fatal_error ();
             }
         }
-                                   
-      iter = g_list_next (iter);
     }
 
   /* Make sure we didn't drag in any conflicts via Requires
    * (inefficient algorithm, who cares)
    */
-  visited = g_hash_table_new (g_str_hash, g_str_equal);
-  recursive_fill_list (pkg, TRUE, visited, &requires);
-  g_hash_table_destroy (visited);
+  requires = g_ptr_array_new ();
+  packages_closure (&root, TRUE, requires);
   conflicts = pkg->conflicts;
 
-  requires_iter = requires;
-  while (requires_iter != NULL)
+  for (j = 0; j < requires->len; j++)
     {
-      Package *req = requires_iter->data;
+      Package *req = g_ptr_array_index (requires, j);
       
       conflicts_iter = conflicts;
 
@@ -753,16 +1476,31 @@ verify_package (Package *pkg)
                              ver->owner->key,
                              ver->owner->version);
 
-              exit (1);
+              fatal_error ();
             }
 
           conflicts_iter = g_list_next (conflicts_iter);
         }
-      
-      requires_iter = g_list_next (requires_iter);
     }
   
-  g_list_free (requires);
+  g_ptr_array_free (requires, TRUE);
+}
+
+/* Remove the system include and library directories compilers already
+ * search from a package's flags.
+ */
+static void
+strip_system_flags (Package *pkg)
+{
+  GList *system_directories = NULL;
+  GList *iter;
+  GList *system_dir_iter = NULL;
+  GList *system_flags;
+  GList *spaced_system_flags;
+  int count;
+  const gchar *search_path;
+  const gchar **include_envvars;
+  const gchar **var;
 
   /* We make a list of system directories that compilers expect so we
    * can remove them.
@@ -789,53 +1527,45 @@ verify_package (Package *pkg)
         system_directories = add_env_variable_to_list (system_directories, search_path);
     }
 
+  /* Flag args are interned, so a flag naming a system directory is the
+   * same pointer as the interned -I flag for it.
+   */
+  system_flags = intern_system_flags (system_directories, "-I");
+
   count = 0;
   for (iter = pkg->cflags; iter != NULL; iter = g_list_next (iter))
     {
-      gint offset = 0;
       Flag *flag = iter->data;
 
       if (!(flag->type & CFLAGS_I))
         continue;
 
       /* Handle the system cflags. We put things in canonical
-       * -I/usr/include (vs. -I /usr/include) format, but if someone
-       * changes it later we may as well be robust.
+       * -I/usr/include (vs. -I /usr/include) format.
        *
        * Note that the -i* flags are left out of this handling since
        * they're intended to adjust the system cflags behavior.
        */
-      if (((strncmp (flag->arg, "-I", 2) == 0) && (offset = 2))||
-          ((strncmp (flag->arg, "-I ", 3) == 0) && (offset = 3)))
+      for (system_dir_iter = system_flags; system_dir_iter != NULL;
+           system_dir_iter = system_dir_iter->next)
         {
-	  if (offset == 0)
-	    {
-	      iter = iter->next;
-	      continue;
-	    }
-
-	  system_dir_iter = system_directories;
-	  while (system_dir_iter != NULL)
-	    {
-	      if (strcmp (system_dir_iter->data,
-                          ((char*)flag->arg) + offset) == 0)
-		{
-                  debug_spew ("Package %s has %s in Cflags\n",
-			      pkg->key, (gchar *)flag->arg);
-		  if (g_getenv ("PKG_CONFIG_ALLOW_SYSTEM_CFLAGS") == NULL)
-		    {
-                      debug_spew ("Removing %s from cflags for %s\n",
-                                  flag->arg, pkg->key);
-		      ++count;
-		      iter->data = NULL;
-
-		      break;
-		    }
-		}
-	      system_dir_iter = system_dir_iter->next;
-	    }
+          if (system_dir_iter->data == flag->arg)
+            {
+              debug_spew ("Package %s has %s in Cflags\n",
+                          pkg->key, flag->arg);
+              if (g_getenv ("PKG_CONFIG_ALLOW_SYSTEM_CFLAGS") == NULL)
+                {
+                  debug_spew ("Removing %s from cflags for %s\n",
+                              flag->arg, pkg->key);
+                  ++count;
+                  iter->data = NULL;
+
+                  break;
+                }
+            }
         }
     }
+  g_list_free (system_flags);
 
   while (count)
     {
@@ -857,10 +1587,15 @@ verify_package (Package *pkg)
 
   system_directories = add_env_variable_to_list (system_directories, search_path);
 
+  system_flags = intern_system_flags (system_directories, "-L");
+  spaced_system_flags = intern_system_flags (system_directories, "-L ");
+
   count = 0;
   for (iter = pkg->libs; iter != NULL; iter = g_list_next (iter))
     {
       GList *system_dir_iter = system_directories;
+      GList *flag_iter = system_flags;
+      GList *spaced_iter = spaced_system_flags;
       Flag *flag = iter->data;
 
       if (!(flag->type & LIBS_L))
@@ -868,17 +1603,9 @@ verify_package (Package *pkg)
 
       while (system_dir_iter != NULL)
         {
-          gboolean is_system = FALSE;
-          const char *linker_arg = flag->arg;
           const char *system_libpath = system_dir_iter->data;
 
-          if (strncmp (linker_arg, "-L ", 3) == 0 &&
-              strcmp (linker_arg + 3, system_libpath) == 0)
-            is_system = TRUE;
-          else if (strncmp (linker_arg, "-L", 2) == 0 &&
-              strcmp (linker_arg + 2, system_libpath) == 0)
-            is_system = TRUE;
-          if (is_system)
+          if (flag->arg == spaced_iter->data || flag->arg == flag_iter->data)
             {
               debug_spew ("Package %s has -L %s in Libs\n",
                           pkg->key, system_libpath);
@@ -892,8 +1619,12 @@ verify_package (Package *pkg)
                 }
             }
           system_dir_iter = system_dir_iter->next;
+          flag_iter = flag_iter->next;
+          spaced_iter = spaced_iter->next;
         }
     }
+  g_list_free (system_flags);
+  g_list_free (spaced_system_flags);
   g_list_free (system_directories);
 
   while (count)
@@ -903,6 +1634,49 @@ verify_package (Package *pkg)
     }
 }
 
+/* Libs and Cflags are only split into flags when something reads them,
+ * so that queries for versions or variables never pay for it. Load the
+ * flags of a package before reading them.
+ */
+void
+package_load_flags (Package *pkg)
+{
+  if (pkg->flags_loaded)
+    return;
+  pkg->flags_loaded = TRUE;
+
+  parse_package_flags (pkg);
+  strip_system_flags (pkg);
+}
+
+static void
+freeze_requires (Package *pkg)
+{
+  int i;
+
+  if (pkg->frozen)
+    return;
+  pkg->frozen = TRUE;
+
+  package_load_flags (pkg);
+  parse_package_variables (pkg);
+
+  for (i = 0; i < pkg->n_requires_private; i++)
+    freeze_requires (pkg->requires_private[i]);
+}
+
+/* Load everything a package and the packages it requires would load on
+ * first use, so that reading them never modifies them. The package will
+ * be queried, so its closures are memoized too.
+ */
+void
+package_freeze (Package *pkg)
+{
+  freeze_requires (pkg);
+  package_memoize_closure (pkg, TRUE);
+  package_memoize_closure (pkg, FALSE);
+}
+
 /* Create a merged list of required packages and retrieve the flags from them.
  * Strip the duplicates from the flags list. The sorting and stripping can be
  * done in one of two ways: packages sorted by position in the pkg-config path
@@ -911,15 +1685,16 @@ verify_package (Package *pkg)
  * The former is done for -I/-L flags, and the latter for all others.
  */
 static char *
-get_multi_merged (GList *pkgs, FlagType type, gboolean in_path_order,
-                  gboolean include_private)
+get_multi_merged (FlagSources *sources, FlagType type, gboolean in_path_order,
+                  gboolean include_private, const char *sysroot)
 {
   GList *list;
   char *retval;
 
-  list = fill_list (pkgs, type, in_path_order, include_private);
+  list = merge_flag_lists (fill_list (sources, in_path_order,
+                                      include_private), type);
   list = flag_list_strip_duplicates (list);
-  retval = flag_list_to_string (list);
+  retval = flag_list_to_string (list, sysroot);
   g_list_free (list);
 
   return retval;
@@ -928,42 +1703,55 @@ get_multi_merged (GList *pkgs, FlagType type, gboolean in_path_order,
 char *
 packages_get_flags (GList *pkgs, FlagType flags)
 {
+  return packages_get_flags_full (pkgs, flags, !ignore_private_libs,
+                                  pcsysrootdir);
+}
+
+char *
+packages_get_flags_full (GList *pkgs, FlagType flags,
+                         gboolean include_private, const char *sysroot)
+{
+  FlagSources sources;
   GString *str;
   char *cur;
 
+  memset (&sources, 0, sizeof (sources));
+  sources.packages = pkgs;
   str = g_string_new (NULL);
 
   /* sort packages in path order for -L/-I, dependency order otherwise */
   if (flags & CFLAGS_OTHER)
     {
-      cur = get_multi_merged (pkgs, CFLAGS_OTHER, FALSE, TRUE);
+      cur = get_multi_merged (&sources, CFLAGS_OTHER, FALSE, TRUE, sysroot);
       debug_spew ("adding CFLAGS_OTHER string \"%s\"\n", cur);
       g_string_append (str, cur);
       g_free (cur);
     }
   if (flags & CFLAGS_I)
     {
-      cur = get_multi_merged (pkgs, CFLAGS_I, TRUE, TRUE);
+      cur = get_multi_merged (&sources, CFLAGS_I, TRUE, TRUE, sysroot);
       debug_spew ("adding CFLAGS_I string \"%s\"\n", cur);
       g_string_append (str, cur);
       g_free (cur);
     }
   if (flags & LIBS_L)
     {
-      cur = get_multi_merged (pkgs, LIBS_L, TRUE, !ignore_private_libs);
+      cur = get_multi_merged (&sources, LIBS_L, TRUE, include_private, sysroot);
       debug_spew ("adding LIBS_L string \"%s\"\n", cur);
       g_string_append (str, cur);
       g_free (cur);
     }
   if (flags & (LIBS_OTHER | LIBS_l))
     {
-      cur = get_multi_merged (pkgs, flags & (LIBS_OTHER | LIBS_l), FALSE,
-                              !ignore_private_libs);
+      cur = get_multi_merged (&sources, flags & (LIBS_OTHER | LIBS_l), FALSE,
+                              include_private, sysroot);
       debug_spew ("adding LIBS_OTHER | LIBS_l string \"%s\"\n", cur);
       g_string_append (str, cur);
       g_free (cur);
     }
 
+  flag_sources_free (&sources);
+
   /* Strip trailing space. */
   if (str->len > 0 && str->str[str->len - 1] == ' ')
     g_string_truncate (str, str->len - 1);
@@ -977,12 +1765,12 @@ define_global_variable (const char *varname,
                         const char *varval)
 {
   if (globals == NULL)
-    globals = g_hash_table_new (g_str_hash, g_str_equal);
+    globals = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 
   if (g_hash_table_lookup (globals, varname))
     {
       verbose_error ("Variable '%s' defined twice globally\n", varname);
-      exit (1);
+      fatal_error ();
     }
   
   g_hash_table_insert (globals, g_strdup (varname), g_strdup (varval));
@@ -991,6 +1779,112 @@ define_global_variable (const char *varname,
               varname, varval);
 }
 
+void
+clear_global_variables (void)
+{
+  if (globals != NULL)
+    g_hash_table_remove_all (globals);
+}
+
+GHashTable *
+copy_global_variables (void)
+{
+  GHashTable *copy = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free);
+  GHashTableIter iter;
+  gpointer name;
+  gpointer value;
+
+  if (globals == NULL)
+    return copy;
+
+  g_hash_table_iter_init (&iter, globals);
+  while (g_hash_table_iter_next (&iter, &name, &value))
+    g_hash_table_insert (copy, g_strdup (name), g_strdup (value));
+
+  return copy;
+}
+
+/* Describe the global variables in a stable order, for use in cache
+ * and package table keys. Each escaped name and value is on its own line.
+ */
+void
+global_variables_to_string (GString *str)
+{
+  GList *names;
+  GList *iter;
+
+  if (globals == NULL)
+    return;
+
+  names = g_list_sort (g_hash_table_get_keys (globals),
+                       (GCompareFunc) strcmp);
+  for (iter = names; iter != NULL; iter = g_list_next (iter))
+    {
+      char *name = g_strescape (iter->data, NULL);
+      char *value = g_strescape (g_hash_table_lookup (globals, iter->data),
+                                 NULL);
+
+      g_string_append_printf (str, "%s\n%s\n", name, value);
+      g_free (name);
+      g_free (value);
+    }
+  g_list_free (names);
+}
+
+/* Environment variables that don't affect how a .pc file is parsed */
+static const char *ignored_envvars[] = {
+  "PKG_CONFIG_PATH",
+  "PKG_CONFIG_LIBDIR",
+  "PKG_CONFIG_CACHE_DIR",
+  "PKG_CONFIG_LOG",
+  "PKG_CONFIG_DEBUG_SPEW",
+  NULL
+};
+
+static gboolean
+envvar_is_ignored (const char *name)
+{
+  const char **ignored;
+
+  for (ignored = ignored_envvars; *ignored != NULL; ignored++)
+    {
+      if (strcmp (name, *ignored) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Describe the PKG_CONFIG_* environment variables, which can override
+ * package variables, like global_variables_to_string() does.
+ */
+void
+environment_variables_to_string (GString *str)
+{
+  gchar **envvars;
+  gchar **var;
+
+  envvars = g_listenv ();
+  g_qsort_with_data (envvars, g_strv_length (envvars), sizeof (gchar *),
+                     (GCompareDataFunc) g_strcmp0, NULL);
+  for (var = envvars; *var != NULL; var++)
+    {
+      char *name;
+      char *value;
+
+      if (!g_str_has_prefix (*var, "PKG_CONFIG_") || envvar_is_ignored (*var))
+        continue;
+
+      name = g_strescape (*var, NULL);
+      value = g_strescape (g_getenv (*var), NULL);
+      g_string_append_printf (str, "%s\n%s\n", name, value);
+      g_free (name);
+      g_free (value);
+    }
+  g_strfreev (envvars);
+}
+
 char *
 var_to_env_var (const char *pkg, const char *var)
 {
@@ -1013,36 +1907,233 @@ char *
 package_get_var (Package *pkg,
                  const char *var)
 {
-  char *varval = NULL;
+  return package_get_var_full (pkg, var, globals);
+}
 
-  if (globals)
-    varval = g_strdup (g_hash_table_lookup (globals, var));
+char *
+package_get_var_full (Package    *pkg,
+                      const char *var,
+                      GHashTable *globals)
+{
+  char *varval = NULL;
 
-  /* Allow overriding specific variables using an environment variable of the
-   * form PKG_CONFIG_$PACKAGENAME_$VARIABLE
+  /* Packages in the current table memoize their overrides, see
+   * package_get_override(). Frozen packages belong to a snapshot and are
+   * shared between threads, so they're only read.
    */
-  if (pkg->key)
+  if (pkg->key && !pkg->frozen)
+    {
+      varval = g_strdup (package_get_override (pkg, var));
+      if (varval != NULL)
+        return varval;
+    }
+  else
     {
-      char *env_var = var_to_env_var (pkg->key, var);
-      const char *env_var_content = g_getenv (env_var);
-      g_free (env_var);
-      if (env_var_content)
+      if (globals)
+        varval = g_strdup (g_hash_table_lookup (globals, var));
+
+      /* Allow overriding specific variables using an environment variable
+       * of the form PKG_CONFIG_$PACKAGENAME_$VARIABLE
+       */
+      if (pkg->key)
         {
-          debug_spew ("Overriding variable '%s' from environment\n", var);
-          return g_strdup (env_var_content);
+          char *env_var = var_to_env_var (pkg->key, var);
+          const char *env_var_content = g_getenv (env_var);
+          g_free (env_var);
+          if (env_var_content)
+            {
+              debug_spew ("Overriding variable '%s' from environment\n",
+                          var);
+              g_free (varval);
+              return g_strdup (env_var_content);
+            }
         }
     }
 
-
   if (varval == NULL && pkg->vars)
-    varval = g_strdup (g_hash_table_lookup (pkg->vars, var));
+    {
+      Variable *variable = g_hash_table_lookup (pkg->vars, var);
+
+      if (variable != NULL)
+        varval = g_strdup (parse_variable_value (pkg, variable));
+    }
 
   return varval;
 }
 
+/* A package's strings and structs are carved out of a few large blocks
+ * that are freed together with it, rather than allocated one by one.
+ * Requests too big for a block get a block of their own.
+ */
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN (2 * sizeof (gpointer))
+
+static gpointer
+arena_alloc (Package *pkg, gsize size, gsize align)
+{
+  gsize pad = (align - GPOINTER_TO_SIZE (pkg->arena_pos) % align) % align;
+  char *mem;
+
+  if (size + pad > pkg->arena_left)
+    {
+      if (size > ARENA_BLOCK_SIZE / 4)
+        {
+          mem = g_malloc (size);
+          pkg->arena = g_slist_prepend (pkg->arena, mem);
+          return mem;
+        }
+
+      pkg->arena_pos = g_malloc (ARENA_BLOCK_SIZE);
+      pkg->arena_left = ARENA_BLOCK_SIZE;
+      pkg->arena = g_slist_prepend (pkg->arena, pkg->arena_pos);
+      pad = 0;
+    }
+
+  mem = pkg->arena_pos + pad;
+  pkg->arena_pos += pad + size;
+  pkg->arena_left -= pad + size;
+
+  return mem;
+}
+
+/* Zeroed memory that lives as long as the package. Without a package,
+ * it's allocated on its own.
+ */
+gpointer
+package_alloc (Package *pkg, gsize size)
+{
+  if (pkg == NULL)
+    return g_malloc0 (size);
+
+  return memset (arena_alloc (pkg, size, ARENA_ALIGN), 0, size);
+}
+
+char *
+package_strndup (Package *pkg, const char *str, gsize len)
+{
+  char *copy;
+
+  if (pkg == NULL)
+    return g_strndup (str, len);
+
+  copy = arena_alloc (pkg, len + 1, 1);
+  memcpy (copy, str, len);
+  copy[len] = '\0';
+
+  return copy;
+}
+
+char *
+package_strdup (Package *pkg, const char *str)
+{
+  if (str == NULL)
+    return NULL;
+
+  return package_strndup (pkg, str, strlen (str));
+}
+
+/* Ids are dense, so sets of packages can be bitsets indexed by them.
+ * They're never reused, as packages from different contexts and
+ * snapshots may meet in one process.
+ */
+static gint next_package_id = 0;
+
+Package *
+package_new (void)
+{
+  Package *pkg = g_new0 (Package, 1);
+
+  pkg->id = g_atomic_int_add (&next_package_id, 1);
+
+  return pkg;
+}
+
+/* Free a package that nothing refers to any more */
+void
+package_free (Package *pkg)
+{
+  if (pkg->vars)
+    g_hash_table_destroy (pkg->vars);
+  if (pkg->overrides)
+    g_hash_table_destroy (pkg->overrides);
+  if (pkg->required_versions)
+    g_hash_table_destroy (pkg->required_versions);
+  g_list_free (pkg->requires_entries);
+  g_list_free (pkg->requires_private_entries);
+  g_list_free (pkg->libs);
+  g_list_free (pkg->cflags);
+  g_list_free (pkg->conflicts);
+  g_list_free (pkg->unparsed_flags);
+  g_slist_free_full (pkg->arena, g_free);
+  g_free (pkg);
+}
+
+/* Define a variable of a package, keeping the name and value without
+ * copying them.
+ */
+void
+package_set_var (Package *pkg, const char *name, char *value,
+                 gboolean expanded)
+{
+  Variable *variable = package_alloc (pkg, sizeof (Variable));
+
+  if (pkg->vars == NULL)
+    pkg->vars = g_hash_table_new (g_str_hash, g_str_equal);
+
+  variable->value = value;
+  variable->expanded = expanded;
+  variable->position = g_hash_table_size (pkg->vars);
+  g_hash_table_insert (pkg->vars, (char *) name, variable);
+}
+
+/* The global or environment value overriding a package's variable, or
+ * NULL. Expanding a package's variables looks the same names up over and
+ * over, so the answers are kept with the package. Its table is specific
+ * to the global variables and the PKG_CONFIG_* environment, so a later
+ * change to either gets a fresh table rather than stale answers.
+ */
+const char *
+package_get_override (Package *pkg, const char *var)
+{
+  gpointer value;
+  char *env_var;
+  const char *env_var_content;
+
+  if (pkg->overrides == NULL)
+    pkg->overrides = g_hash_table_new (g_str_hash, g_str_equal);
+  else if (g_hash_table_lookup_extended (pkg->overrides, var, NULL, &value))
+    return value;
+
+  env_var = var_to_env_var (pkg->key, var);
+  env_var_content = g_getenv (env_var);
+  g_free (env_var);
+
+  if (env_var_content != NULL)
+    {
+      debug_spew ("Overriding variable '%s' from environment\n", var);
+      value = package_strdup (pkg, env_var_content);
+    }
+  else if (globals != NULL)
+    value = package_strdup (pkg, g_hash_table_lookup (globals, var));
+  else
+    value = NULL;
+
+  g_hash_table_insert (pkg->overrides, package_strdup (pkg, var), value);
+
+  return value;
+}
+
 char *
 packages_get_var (GList      *pkgs,
                   const char *varname)
+{
+  return packages_get_var_full (pkgs, varname, globals);
+}
+
+char *
+packages_get_var_full (GList      *pkgs,
+                       const char *varname,
+                       GHashTable *globals)
 {
   GList *tmp;
   GString *str;
@@ -1055,7 +2146,7 @@ packages_get_var (GList      *pkgs,
       Package *pkg = tmp->data;
       char *var;
 
-      var = parse_package_variable (pkg, varname);
+      var = parse_package_variable (pkg, varname, globals);
       if (var)
         {
           if (str->len > 0)
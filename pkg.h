@@ -21,6 +21,7 @@
 #define PKG_CONFIG_PKG_H
 
 #include <glib.h>
+#include <stdarg.h>
 
 typedef guint8 FlagType; /* bit mask for flag types */
 
@@ -48,11 +49,15 @@ typedef enum
 typedef struct Flag_ Flag;
 typedef struct Package_ Package;
 typedef struct RequiredVersion_ RequiredVersion;
+typedef struct Variable_ Variable;
 
+/* Flag args, package keys and pcfiledirs are interned with
+ * g_intern_string(), so equal ones are the same pointer.
+ */
 struct Flag_
 {
   FlagType type;
-  char *arg;
+  const char *arg;
 };
 
 struct RequiredVersion_
@@ -63,8 +68,20 @@ struct RequiredVersion_
   Package *owner;
 };
 
+/* Variables are stored as written and expanded on first use. A value
+ * only sees the variables defined before it, as when the file is read
+ * line by line.
+ */
+struct Variable_
+{
+  char *value;
+  gboolean expanded; /* value has had its ${} references substituted */
+  int position; /* order of definition in the package */
+};
+
 struct Package_
 {
+  guint id; /* dense number from package_new() */
   char *key;  /* filename name */
   char *name; /* human-readable name */
   char *version;
@@ -72,12 +89,24 @@ struct Package_
   char *url;
   char *pcfiledir; /* directory it was loaded from */
   GList *requires_entries;
-  GList *requires;
   GList *requires_private_entries;
-  GList *requires_private;
+  /* The resolved Requires.private followed by the resolved Requires, in
+   * one array. requires points at the Requires part of it.
+   */
+  Package **requires_private;
+  Package **requires;
+  int n_requires_private; /* including the Requires */
+  int n_requires;
+  /* Memoized closures of the package with and without Requires.private,
+   * NULL terminated, see package_memoize_closure().
+   */
+  Package **closure_private;
+  Package **closure;
   GList *libs;
   GList *cflags;
-  GHashTable *vars;
+  char *path; /* .pc file it was parsed from, for messages */
+  GHashTable *vars; /* hash from name to Variable */
+  GHashTable *overrides; /* memoized global and environment values of variables */
   GHashTable *required_versions; /* hash from name to RequiredVersion */
   GList *conflicts; /* list of RequiredVersion */
   gboolean uninstalled; /* used the -uninstalled file */
@@ -85,6 +114,12 @@ struct Package_
   int libs_num; /* Number of times the "Libs" header has been seen */
   int libs_private_num;  /* Number of times the "Libs.private" header has been seen */
   char *orig_prefix; /* original prefix value before redefinition */
+  GList *unparsed_flags; /* Libs, Libs.private and Cflags values not split yet */
+  gboolean flags_loaded; /* libs and cflags are complete, see package_load_flags() */
+  gboolean frozen; /* everything is loaded, see package_freeze() */
+  GSList *arena; /* blocks holding the package's strings and structs */
+  char *arena_pos; /* free space left in the current block */
+  gsize arena_left;
 };
 
 Package *get_package               (const char *name);
@@ -95,10 +130,75 @@ char *   package_get_var           (Package    *pkg,
                                     const char *var);
 char *   packages_get_var          (GList      *pkgs,
                                     const char *var);
+void     package_set_var           (Package    *pkg,
+                                    const char *name,
+                                    char       *value,
+                                    gboolean    expanded);
+const char *package_get_override   (Package    *pkg,
+                                    const char *var);
+void     package_load_flags        (Package    *pkg);
+Package *package_new               (void);
+gpointer package_alloc             (Package    *pkg,
+                                    gsize       size);
+char *   package_strdup            (Package    *pkg,
+                                    const char *str);
+char *   package_strndup           (Package    *pkg,
+                                    const char *str,
+                                    gsize       len);
+void     package_free              (Package    *pkg);
+void     package_freeze            (Package    *pkg);
+
+/* Variants taking the settings the above read from pkg.c's state, for
+ * snapshots queried from other threads.
+ */
+char *   packages_get_flags_full   (GList      *pkgs,
+                                    FlagType    flags,
+                                    gboolean    include_private,
+                                    const char *sysroot);
+char *   package_get_var_full      (Package    *pkg,
+                                    const char *var,
+                                    GHashTable *globals);
+char *   packages_get_var_full     (GList      *pkgs,
+                                    const char *var,
+                                    GHashTable *globals);
+
+/* Everything pkg.c and parse.c keep between calls, so that a context
+ * can swap in its own copy.
+ */
+typedef struct
+{
+  GHashTable *packages;
+  GHashTable *package_tables;
+  char *packages_key;
+  GHashTable *globals;
+  GList *search_dirs;
+  GList *files_read;
+  unsigned int search_dirs_consulted;
+  gboolean disable_uninstalled;
+  gboolean ignore_requires;
+  gboolean ignore_requires_private;
+  gboolean ignore_private_libs;
+  gboolean parse_strict;
+  gboolean define_prefix;
+  char *prefix_variable;
+#ifdef G_OS_WIN32
+  gboolean msvc_syntax;
+#endif
+  char *pcsysrootdir;
+  char *pkg_config_pc_path;
+} PackageState;
+
+void package_state_swap (PackageState *state);
 
 void add_search_dir (const char *path);
 void add_search_dirs (const char *path, const char *separator);
+GList *get_search_dirs (void);
+GList *get_files_read (void);
+GList *get_search_dirs_consulted (void);
 void package_init (gboolean want_list);
+void package_discard (void);
+void package_invalidate (const char *name);
+gboolean rebuild_search_index (void);
 int compare_versions (const char * a, const char *b);
 gboolean version_test (ComparisonType comparison,
                        const char *a,
@@ -110,9 +210,26 @@ void print_package_list (void);
 
 void define_global_variable (const char *varname,
                              const char *varval);
+void clear_global_variables (void);
+void global_variables_to_string (GString *str);
+void environment_variables_to_string (GString *str);
+GHashTable *copy_global_variables (void);
+
+/* Messages and fatal errors are passed to handlers, so the command line
+ * tool can print them and library contexts can collect them. Handlers
+ * are per thread. Without a fatal error handler, or if it returns, the
+ * process exits.
+ */
+typedef void (*MessageHandler) (const char *format, va_list args);
+typedef void (*FatalErrorHandler) (void);
+
+void set_message_handlers (MessageHandler     debug_spew_handler,
+                           MessageHandler     verbose_error_handler,
+                           FatalErrorHandler  fatal_error_handler);
 
 void debug_spew (const char *format, ...);
 void verbose_error (const char *format, ...);
+void fatal_error (void) G_GNUC_NORETURN;
 
 gboolean name_ends_in_uninstalled (const char *str);
 
@@ -0,0 +1,669 @@
+/*
+ * Copyright (C) 2001, 2002 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "server.h"
+#include "pkg.h"
+#include "index.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/* A request is a native-endian 32-bit length, sent along with the
+ * client's stdout and stderr, followed by a serialized GVariant holding
+ * the working directory, the command line and the environment variables
+ * that can affect the result. The reply is the 32-bit exit status.
+ */
+#define SERVER_REQUEST_TYPE "(sasas)"
+
+/* Replied instead of an exit status when the client should answer the
+ * query itself
+ */
+#define SERVER_FALLBACK -1
+
+/* Requests are a command line and some environment variables, so this
+ * is plenty.
+ */
+#define SERVER_MAX_REQUEST (1024 * 1024)
+
+/* Clients send their request right after connecting. One that doesn't
+ * within this many seconds is dropped, since queries are answered one
+ * at a time.
+ */
+#define SERVER_CLIENT_TIMEOUT 5
+
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+                      IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Environment variables besides PKG_CONFIG_* that affect the output */
+static const char *server_envvars[] = {
+  "CPATH",
+  "C_INCLUDE_PATH",
+  "CPP_INCLUDE_PATH",
+  NULL
+};
+
+static ServerQueryFunc server_query = NULL;
+static GVariant *server_environment = NULL;
+static char *server_cwd = NULL;
+static gboolean relative_search_path = FALSE;
+static int inotify_fd = -1;
+static GHashTable *watches = NULL;     /* watch descriptor -> directory */
+static GList *unwatched_dirs = NULL;   /* directories not watched yet */
+
+static const char *
+server_socket_path (void)
+{
+  const char *path = g_getenv ("PKG_CONFIG_SERVER");
+
+  if (path == NULL || *path == '\0')
+    return NULL;
+
+  return path;
+}
+
+/* The environment variables affecting a query, in a stable order. The
+ * server only answers clients whose environment matches its own.
+ */
+static GVariant *
+environment_to_variant (void)
+{
+  GVariantBuilder builder;
+  gchar **envvars;
+  gchar **var;
+  const char **name;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+
+  envvars = g_listenv ();
+  g_qsort_with_data (envvars, g_strv_length (envvars), sizeof (gchar *),
+                     (GCompareDataFunc) g_strcmp0, NULL);
+  for (var = envvars; *var != NULL; var++)
+    {
+      char *str;
+
+      if (!g_str_has_prefix (*var, "PKG_CONFIG_") ||
+          strcmp (*var, "PKG_CONFIG_SERVER") == 0)
+        continue;
+
+      str = g_strconcat (*var, "=", g_getenv (*var), NULL);
+      g_variant_builder_add (&builder, "s", str);
+      g_free (str);
+    }
+  g_strfreev (envvars);
+
+  for (name = server_envvars; *name != NULL; name++)
+    {
+      const char *value = g_getenv (*name);
+      char *str;
+
+      if (value == NULL)
+        continue;
+
+      str = g_strconcat (*name, "=", value, NULL);
+      g_variant_builder_add (&builder, "s", str);
+      g_free (str);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+static gboolean
+read_all (int fd, void *buf, size_t len)
+{
+  char *p = buf;
+
+  while (len > 0)
+    {
+      ssize_t n = read (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+      p += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_all (int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+
+  while (len > 0)
+    {
+      ssize_t n = write (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+      p += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+static int
+server_connect (const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    return -1;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/* Send the request length with our stdout and stderr attached */
+static gboolean
+send_header (int fd, guint32 len)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE (2 * sizeof (int))];
+  int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+
+  memset (&msg, 0, sizeof (msg));
+  memset (control, 0, sizeof (control));
+  iov.iov_base = &len;
+  iov.iov_len = sizeof (len);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+  memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+  return sendmsg (fd, &msg, 0) == sizeof (len);
+}
+
+static gboolean
+receive_header (int fd, guint32 *len, int fds[2])
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE (2 * sizeof (int))];
+  ssize_t n;
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = len;
+  iov.iov_len = sizeof (*len);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  do
+    n = recvmsg (fd, &msg, 0);
+  while (n < 0 && errno == EINTR);
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+      int *received = (int *) CMSG_DATA (cmsg);
+      size_t n_received;
+      size_t i;
+
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+
+      n_received = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+      if (n_received == 2 && fds[0] < 0)
+        memcpy (fds, received, 2 * sizeof (int));
+      else
+        {
+          /* They're ours now, wanted or not */
+          for (i = 0; i < n_received; i++)
+            close (received[i]);
+        }
+    }
+
+  return n == sizeof (*len) && fds[0] >= 0 && fds[1] >= 0;
+}
+
+int
+server_forward (int argc, char **argv)
+{
+  const char *path = server_socket_path ();
+  GVariant *request;
+  gchar *cwd;
+  gint32 status;
+  int fd;
+
+  if (path == NULL)
+    return -1;
+
+  fd = server_connect (path);
+  if (fd < 0)
+    return -1;
+
+  cwd = g_get_current_dir ();
+  request = g_variant_new ("(s^as@as)", cwd, argv, environment_to_variant ());
+  g_variant_ref_sink (request);
+  g_free (cwd);
+
+  /* Anything written so far would otherwise come out after the answer */
+  fflush (stdout);
+  fflush (stderr);
+
+  if (!send_header (fd, g_variant_get_size (request)) ||
+      !write_all (fd, g_variant_get_data (request),
+                  g_variant_get_size (request)))
+    status = SERVER_FALLBACK;
+  else if (!read_all (fd, &status, sizeof (status)))
+    {
+      fprintf (stderr, "pkg-config server at '%s' didn't answer\n", path);
+      status = 1;
+    }
+
+  g_variant_unref (request);
+  close (fd);
+
+  return status;
+}
+
+/* Answers don't depend on the working directory unless the search path
+ * or a .pc file named on the command line is relative to it.
+ */
+static gboolean
+depends_on_cwd (const gchar **argv)
+{
+  const gchar **arg;
+
+  if (relative_search_path)
+    return TRUE;
+
+  for (arg = argv; *arg != NULL; arg++)
+    {
+      if (g_str_has_suffix (*arg, ".pc") && !g_path_is_absolute (*arg))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+watch_dirs (void)
+{
+  GList *iter = unwatched_dirs;
+
+  while (iter != NULL)
+    {
+      GList *next = g_list_next (iter);
+      char *path = iter->data;
+      int wd = inotify_add_watch (inotify_fd, *path ? path : "/",
+                                  INOTIFY_MASK);
+
+      if (wd >= 0)
+        {
+          debug_spew ("Watching directory '%s'\n", path);
+          g_hash_table_insert (watches, GINT_TO_POINTER (wd), path);
+          unwatched_dirs = g_list_delete_link (unwatched_dirs, iter);
+
+          /* It may have appeared since its contents were last looked at */
+          index_invalidate (path);
+          package_invalidate (NULL);
+        }
+      iter = next;
+    }
+}
+
+static void
+handle_event (struct inotify_event *event)
+{
+  char *path = g_hash_table_lookup (watches, GINT_TO_POINTER (event->wd));
+  char *name;
+
+  if (event->mask & IN_Q_OVERFLOW)
+    {
+      debug_spew ("Lost track of search directory changes\n");
+      index_invalidate (NULL);
+      package_invalidate (NULL);
+      return;
+    }
+
+  if (path == NULL)
+    return;
+
+  if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+    {
+      debug_spew ("Search directory '%s' went away\n", path);
+      inotify_rm_watch (inotify_fd, event->wd);
+      g_hash_table_remove (watches, GINT_TO_POINTER (event->wd));
+      unwatched_dirs = g_list_prepend (unwatched_dirs, path);
+      index_invalidate (path);
+      package_invalidate (NULL);
+      return;
+    }
+
+  if (event->len == 0 || !g_str_has_suffix (event->name, ".pc"))
+    return;
+
+  index_invalidate (path);
+
+  name = g_strndup (event->name, strlen (event->name) - 3);
+  package_invalidate (name);
+  g_free (name);
+}
+
+/* Apply all pending directory changes. The descriptor is nonblocking, so
+ * this returns once the queue is empty.
+ */
+static void
+process_events (void)
+{
+  /* Aligned for struct inotify_event */
+  guint64 buf[4096 / sizeof (guint64)];
+  ssize_t len;
+
+  while ((len = read (inotify_fd, buf, sizeof (buf))) > 0)
+    {
+      char *p = (char *) buf;
+
+      while (p < (char *) buf + len)
+        {
+          struct inotify_event *event = (struct inotify_event *) p;
+
+          handle_event (event);
+          p += sizeof (struct inotify_event) + event->len;
+        }
+    }
+}
+
+static gboolean
+inotify_cb (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+  process_events ();
+
+  return TRUE;
+}
+
+/* Answer with the client's stdout and stderr in place of our own */
+static gint32
+run_redirected (int fds[2], const gchar **argv)
+{
+  char **args = g_strdupv ((gchar **) argv);
+  int saved_stdout;
+  int saved_stderr;
+  gint32 status;
+
+  fflush (stdout);
+  fflush (stderr);
+  saved_stdout = dup (STDOUT_FILENO);
+  saved_stderr = dup (STDERR_FILENO);
+  dup2 (fds[0], STDOUT_FILENO);
+  dup2 (fds[1], STDERR_FILENO);
+
+  status = server_query (g_strv_length (args), args);
+
+  fflush (stdout);
+  fflush (stderr);
+  dup2 (saved_stdout, STDOUT_FILENO);
+  dup2 (saved_stderr, STDERR_FILENO);
+  close (saved_stdout);
+  close (saved_stderr);
+
+  g_strfreev (args);
+
+  return status;
+}
+
+static void
+handle_client (int fd)
+{
+  int fds[2] = { -1, -1 };
+  guint32 len;
+  gchar *data;
+  GVariant *request;
+  const gchar *cwd;
+  const gchar **argv;
+  GVariant *env;
+  gint32 status = SERVER_FALLBACK;
+
+  if (!receive_header (fd, &len, fds) || len > SERVER_MAX_REQUEST)
+    goto out;
+
+  data = g_malloc (len);
+  if (!read_all (fd, data, len))
+    {
+      g_free (data);
+      goto out;
+    }
+
+  request = g_variant_new_from_data (G_VARIANT_TYPE (SERVER_REQUEST_TYPE),
+                                     data, len, FALSE, g_free, data);
+  g_variant_ref_sink (request);
+  g_variant_get (request, "(&s^a&s@as)", &cwd, &argv, &env);
+
+  if (argv[0] == NULL)
+    debug_spew ("Ignoring request without a command line\n");
+  else if (!g_variant_equal (env, server_environment))
+    debug_spew ("Client environment differs, leaving query to it\n");
+  else if (strcmp (cwd, server_cwd) != 0 && depends_on_cwd (argv))
+    debug_spew ("Query depends on the client's directory, leaving it to "
+                "the client\n");
+  else
+    {
+      process_events ();
+      watch_dirs ();
+      status = run_redirected (fds, argv);
+    }
+
+  g_free (argv);
+  g_variant_unref (env);
+  g_variant_unref (request);
+
+ out:
+  write_all (fd, &status, sizeof (status));
+  if (fds[0] >= 0)
+    close (fds[0]);
+  if (fds[1] >= 0)
+    close (fds[1]);
+}
+
+static gboolean
+accept_cb (GIOChannel *source, GIOCondition condition, gpointer data)
+{
+  int fd = accept (g_io_channel_unix_get_fd (source), NULL, NULL);
+  struct timeval timeout = { SERVER_CLIENT_TIMEOUT, 0 };
+
+  if (fd >= 0)
+    {
+      /* A client that never sends its request mustn't hold up others */
+      if (setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                      sizeof (timeout)) != 0)
+        debug_spew ("Cannot set client timeout: %s\n", g_strerror (errno));
+      handle_client (fd);
+      close (fd);
+    }
+
+  return TRUE;
+}
+
+static int
+server_listen (const char *path)
+{
+  struct sockaddr_un addr;
+  mode_t mask;
+  int fd;
+  int ret;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+      fprintf (stderr, "PKG_CONFIG_SERVER path '%s' is too long\n", path);
+      return -1;
+    }
+
+  /* Take over the socket of a server that's gone */
+  fd = server_connect (path);
+  if (fd >= 0)
+    {
+      close (fd);
+      fprintf (stderr, "A pkg-config server is already running at '%s'\n",
+               path);
+      return -1;
+    }
+  unlink (path);
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      fprintf (stderr, "Cannot create socket: %s\n", g_strerror (errno));
+      return -1;
+    }
+
+  /* Clients hand over their stdout and stderr, so only let ours in */
+  mask = umask (077);
+  ret = bind (fd, (struct sockaddr *) &addr, sizeof (addr));
+  umask (mask);
+
+  if (ret != 0 || listen (fd, 64) != 0)
+    {
+      fprintf (stderr, "Cannot listen on '%s': %s\n", path,
+               g_strerror (errno));
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+int
+server_run (GList *dirs, ServerQueryFunc query)
+{
+  const char *path = server_socket_path ();
+  GMainLoop *loop;
+  GIOChannel *channel;
+  int fd;
+
+  if (path == NULL)
+    {
+      fprintf (stderr, "PKG_CONFIG_SERVER must be set to the socket path "
+               "to serve queries on\n");
+      return 1;
+    }
+
+  inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0)
+    {
+      fprintf (stderr, "Cannot watch the search path: %s\n",
+               g_strerror (errno));
+      return 1;
+    }
+
+  fd = server_listen (path);
+  if (fd < 0)
+    return 1;
+
+  /* A client going away mid-answer mustn't take the server with it */
+  signal (SIGPIPE, SIG_IGN);
+
+  server_query = query;
+  server_environment = g_variant_ref_sink (environment_to_variant ());
+  server_cwd = g_get_current_dir ();
+
+  watches = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (; dirs != NULL; dirs = g_list_next (dirs))
+    {
+      if (!g_path_is_absolute (dirs->data))
+        relative_search_path = TRUE;
+      unwatched_dirs = g_list_append (unwatched_dirs, dirs->data);
+    }
+  watch_dirs ();
+
+  debug_spew ("Serving queries on '%s'\n", path);
+
+  loop = g_main_loop_new (NULL, FALSE);
+
+  channel = g_io_channel_unix_new (inotify_fd);
+  g_io_add_watch (channel, G_IO_IN, inotify_cb, NULL);
+  g_io_channel_unref (channel);
+
+  channel = g_io_channel_unix_new (fd);
+  g_io_add_watch (channel, G_IO_IN, accept_cb, NULL);
+  g_io_channel_unref (channel);
+
+  g_main_loop_run (loop);
+
+  return 0;
+}
+
+#else /* !HAVE_SYS_INOTIFY_H */
+
+int
+server_run (GList *dirs, ServerQueryFunc query)
+{
+  fprintf (stderr, "--daemon is not supported on this platform\n");
+  return 1;
+}
+
+int
+server_forward (int argc, char **argv)
+{
+  return -1;
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2001, 2002 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef PKG_CONFIG_SERVER_H
+#define PKG_CONFIG_SERVER_H
+
+#include <glib.h>
+
+/* Answers a query given its command line, returning the exit status */
+typedef int (*ServerQueryFunc) (int argc, char **argv);
+
+/* Serve queries on the PKG_CONFIG_SERVER socket until killed, keeping
+ * parsed packages between queries and dropping those whose .pc files
+ * change in one of the search directories.
+ */
+int server_run     (GList          *dirs,
+                    ServerQueryFunc query);
+
+/* Have the server answer a query, with output going to this process's
+ * stdout and stderr. Returns the exit status, or -1 if there's no server
+ * or it can't answer the query.
+ */
+int server_forward (int             argc,
+                    char          **argv);
+
+#endif